@@ -32,6 +32,141 @@
  *     display un-blanked.  It does this until the other program asks for
  *     it to stop.
  *
+ *   Normally it looks after the one logind session and $DISPLAY that it
+ *   was started in.  With -all-sessions, one copy serves every graphical
+ *   logind session belonging to the user: sessions are discovered with
+ *   ListSessions and followed with SessionNew/SessionRemoved, inhibitors
+ *   are attributed to the session of the process that asked, and on
+ *   suspend "xscreensaver-command" is run once against each of the
+ *   displays, in parallel.  There is still only one system bus
+ *   connection, one PrepareForSleep match and one logind delay lock.
+ *
+ *   It also handles the other ways logind asks for the screen to be
+ *   locked: the "Lock" and "Unlock" signals on a session object (sent by
+ *   "loginctl lock-session", IdleAction=lock, etc.) run "-lock" and
+ *   "-deactivate" for that session, and "PrepareForShutdown" locks all
+ *   sessions while holding a separate "shutdown" delay lock.
+ *
+ *   With -spawn-helper, a small helper process is forked at startup,
+ *   before we have connected to anything, and locks itself into memory.
+ *   Commands are then sent to it over a socketpair and it does the
+ *   fork/exec, so that closing the lid under memory pressure does not
+ *   have to page in the daemon in order to fork it.  The daemon's own
+ *   memory is locked and prefaulted once it has finished setting up.
+ *   If the helper goes away, we go back to forking directly.
+ *
+ *   With -record FILE, every Inhibit, UnInhibit, Renew and PrepareForSleep
+ *   that we handle is appended to FILE as a compact binary trace, with
+ *   monotonic timestamps.  "-replay FILE" plays such a trace back against
+ *   a running daemon, at the recorded pace or "-speed N" times faster,
+ *   and reports call latencies and how many commands the daemon ran.
+ *   See REPLAYING below.
+ *
+ *   "-lease PATTERN=SECONDS" gives inhibitors from applications whose
+ *   name matches the shell pattern a lease: unless the caller calls
+ *   org.jwz.XScreenSaver.Inhibit.Renew with its cookie, the inhibitor
+ *   is dropped after that many seconds, just as if the program had died.
+ *   Every Inhibit gets a cookie of its own, even one that repeats an
+ *   earlier call, so that two inhibitors in one client stay apart.
+ *   The first matching -lease wins; without one, inhibitors last until
+ *   UnInhibit as before.  This puts back the heartbeat's failing safe for
+ *   D-Bus clients that are willing to renew.
+ *
+ *   Clients that would rather not renew anything can call InhibitFd
+ *   (same arguments as Inhibit) on org.jwz.XScreenSaver.Inhibit, which,
+ *   like logind's own Inhibit, returns a file descriptor.  The inhibitor
+ *   lasts exactly as long as that descriptor stays open anywhere: when the
+ *   client closes it or dies, the kernel tells us and it is dropped.
+ *
+ *   With -session-manager, we also answer Inhibit(app_id, toplevel_xid,
+ *   reason, flags) and Uninhibit on org.gnome.SessionManager and
+ *   org.mate.SessionManager, if nobody else has those names.  This is off
+ *   by default, so as not to race a real session manager for them.  Only
+ *   inhibitors with the "idle" flag keep the screen from blanking.  While
+ *   any have the "suspend" flag, we hold one "block" sleep lock from
+ *   logind on behalf of all of them, taken when the first arrives and
+ *   released when the last goes.
+ *
+ *   When built with X11 support, each session also keeps a connection to
+ *   its display and follows the _SCREENSAVER_STATUS property that
+ *   xscreensaver maintains on the root window.  Then "-suspend" and
+ *   "-lock" are not run on a screen that is already locked, heartbeats
+ *   are skipped while the user has been active more recently than the
+ *   last one, and GetActive, GetActiveTime and GetSessionIdleTime on
+ *   org.freedesktop.ScreenSaver are answered from what we already know.
+ *   Each time the screen blanks or unblanks, we also pass that on to
+ *   logind with SetIdleHint on the session, so that IdleAction and the
+ *   like work without anything polling "xscreensaver-command -time".
+ *
+ *   Commands can reach xscreensaver three ways: as the ClientMessage that
+ *   xscreensaver-command itself would send, on our own X connection, and
+ *   waiting as it does for xscreensaver's answer; by way of the
+ *   -spawn-helper; or by running xscreensaver-command here.  At startup
+ *   each is timed from asking to xscreensaver's answer, and from then on
+ *   they are tried cheapest first; until then, only the last two are.  A
+ *   session that one of them cannot reach (its display is gone, the
+ *   helper died, xscreensaver did not answer) falls through to the next.
+ *   The costs are logged with -verbose and are in GetStats.
+ *
+ *   Heartbeats are held back while nobody could see the screen anyway:
+ *   while the lid is closed and nothing else is plugged in (logind's
+ *   LidClosed and Docked, and UPower's LidIsClosed, which tells us when
+ *   it opens again), or, with X11, while DPMS has the display powered
+ *   off.  Running "-deactivate" then would only light up the panel.  When
+ *   the lid opens, any heartbeat that was held back goes out at once.
+ *
+ *   On resume, the X server or the monitor is often not ready yet when
+ *   logind says we are awake, and a "-deactivate" sent then can be lost,
+ *   leaving the unlock dialog to wait for the first keypress.  So each
+ *   session gets its "-deactivate" once its display is ready, retried on
+ *   a fixed schedule of up to about 8 seconds, after which it is sent
+ *   regardless.  With X11, "ready" means that the display can be reached,
+ *   xscreensaver's window is there, and DPMS has the monitor on (we turn
+ *   it on if not); a screen size change or a change in xscreensaver's
+ *   state makes us look again without waiting for the next step.  How
+ *   long that took, from the resume signal to a "-deactivate" that
+ *   worked, is logged and is in GetStats as resume_ready_usec_*.
+ *
+ *   Every pass through the event loop is timed, so that a stall can be
+ *   pinned on what caused it: the busy time, count and worst case of
+ *   each source (each bus, X11, InhibitFd hangups, the config file, our
+ *   own timers, the log), the time spent asleep in poll(), and how many
+ *   callbacks ran per wakeup, all in GetStats as loop_*.  Any one of them
+ *   that takes longer than "slow_callback" in the config file is logged,
+ *   with the bus member it was dispatching, and kept in a ring of the
+ *   last SLOW_RING_SIZE, which ListSlowCallbacks returns.  It costs two
+ *   reads of the vDSO clock per callback, so it is always on.
+ *
+ *   The two halves can also run as separate processes.  "-no-inhibit"
+ *   is the resident core: it holds the sleep and shutdown locks and
+ *   follows Lock and Unlock, with one connection to the system bus and
+ *   none to the session bus.  "-inhibit-only" serves everything on the
+ *   session bus, and keeps the system bus only for the "block" lock, the
+ *   lid and the sessions.  The org.freedesktop.ScreenSaver.service and
+ *   org.jwz.XScreenSaver.service files that "make" writes let the bus
+ *   start it on the first call; once it has held no inhibitors and heard
+ *   nothing for IDLE_EXIT_SECS it gives up its names, answers anything
+ *   that was already queued, and exits.  If that leaves it inhibited after
+ *   all, it queues for its names again, and stays only if it is still
+ *   first in line.  A copy started by the bus only has the environment
+ *   that the session gave the bus, and refuses to run without DISPLAY
+ *   (unless it is given -all-sessions), so the session should run
+ *   "dbus-update-activation-environment DISPLAY XDG_SESSION_ID".  With
+ *   neither option, one process does both, as before.
+ *
+ *   A second copy started with "-standby" waits in the bus's queue for
+ *   org.freedesktop.ScreenSaver and org.jwz.XScreenSaver instead of
+ *   failing.  Meanwhile it is already set up: its objects are registered,
+ *   it holds its own sleep and shutdown locks (letting go of them on
+ *   PrepareForSleep as the active copy does, but running no commands),
+ *   and it follows the sessions.  It does nothing that only the active
+ *   copy should: no heartbeats, no "block" lock, no idle hints and, with
+ *   -session-manager, no asking for those names.  If the active copy
+ *   dies, the bus hands the names on and tells us with NameAcquired, and
+ *   from then on we are the active copy, with nothing left to set up.
+ *   The inhibitors died with the other copy.  The active copy should be
+ *   started with "-standby" too, so that the roles can change back.
+ *
  *
  * BACKGROUND:
  *
@@ -102,8 +237,10 @@
  *
  * TO DO:
  *
- *   - Currently this code is only listening to "org.freedesktop.ScreenSaver".
- *     It should listen to all the others too, because why not.
+ *   - Currently this code is only listening to "org.freedesktop.ScreenSaver",
+ *     and, with -session-manager, "org.gnome.SessionManager" and
+ *     "org.mate.SessionManager".  It should listen to
+ *     "org.freedesktop.PowerManagement.Inhibit" too, because why not.
  *
  *   - What happens if Firefox is playing a video, and has requested to
  *     inhibit the saver, and then is killed with -9?  Do we get a signal to
@@ -118,9 +255,8 @@
  *   - xscreensaver_method_uninhibit() does not actually send a reply, are
  *     we doing the right thing when registering it?
  *
- *   - run under valgrind, etc. to check for any memory leaks.
- *
- *   - call sd_bus_release_name() explicitly on exit?
+ *   - "make soak" only covers the fake bus; run the daemon itself under
+ *     valgrind for a while too.
  *
  * TESTING:
  *
@@ -138,6 +274,78 @@
  *     /ScreenSaver org.freedesktop.ScreenSaver \
  *     UnInhibit u 1792821391
  *
+ *   To see what the running daemon has been doing, and who is currently
+ *   inhibiting it:
+ *
+ *   busctl --user call org.jwz.XScreenSaver \
+ *     /org/jwz/XScreenSaver org.jwz.XScreenSaver.Stats GetStats
+ *
+ *   busctl --user call org.jwz.XScreenSaver \
+ *     /org/jwz/XScreenSaver org.jwz.XScreenSaver.Stats ListInhibitors
+ *
+ *   busctl --user call org.jwz.XScreenSaver \
+ *     /org/jwz/XScreenSaver org.jwz.XScreenSaver.Stats ListSlowCallbacks
+ *
+ *   And to time the command backends again, and see which will be used:
+ *
+ *   busctl --user call org.jwz.XScreenSaver \
+ *     /org/jwz/XScreenSaver org.jwz.XScreenSaver.Stats Calibrate
+ *
+ *   The timer logic can be checked without waiting for it.  The build
+ *   against the fake bus ("make bench" makes one) takes "-simulate SCRIPT",
+ *   which plays Inhibit, UnInhibit, PrepareForSleep and wall clock steps
+ *   at virtual times and prints every command that would have run:
+ *
+ *   printf '0 inhibit mpv video\n120 sleep\n130 resume\n600 end\n' \
+ *     > day.sim
+ *   ./xscreensaver-systemd-fake -simulate day.sim
+ *
+ *   See xscreensaver_simulate() for the script format.  Heartbeats run
+ *   on the monotonic clock, so "jump" should never change them.
+ *
+ *   "make soak" drives millions of Inhibit/UnInhibit pairs and thousands
+ *   of suspend/resume cycles through the same build, and fails if RSS,
+ *   the heap, open fds or live messages keep growing.  It ends with the
+ *   same clean shutdown as SIGTERM, so that for a leak report:
+ *
+ *   valgrind --leak-check=full ./xscreensaver-systemd-fake -soak 2
+ *
+ * REPLAYING:
+ *
+ *   Replays are meant to be run on a private bus, so that they can play
+ *   the part of logind too:
+ *
+ *   eval $(dbus-launch --sh-syntax)
+ *   xscreensaver-systemd -private-bus -session-manager -verbose &
+ *   xscreensaver-systemd -replay field.trace -speed 10
+ *
+ *   -private-bus makes the daemon use the session bus in place of the
+ *   system bus.  The replayer owns org.freedesktop.login1 there, hands out
+ *   delay locks, sends PrepareForSleep, and times how long the daemon
+ *   takes to release its lock before sleep and take it again after.
+ *
+ * TRACING:
+ *
+ *   When built with "make USDT=1" (needs <sys/sdt.h>, from systemtap-sdt-dev
+ *   or systemtap-sdt-devel), the following static probes are compiled in,
+ *   under the provider "xscreensaver".  They are nops unless something is
+ *   attached.  Argument layouts are stable:
+ *
+ *     inhibit            (u32 cookie, char *application, char *owner,
+ *                         int live_inhibitors)
+ *     uninhibit          (u32 cookie, int found, int live_inhibitors)
+ *     sleep_start        (int before_sleep)
+ *     sleep_done         (int before_sleep, u64 elapsed_usec)
+ *     register_sleep_lock (int rc, int fd, u64 elapsed_usec)
+ *     command_start      (char *verb)
+ *     command_exit       (char *verb, int status, u64 elapsed_usec)
+ *     resume_ready       (int retries, u64 elapsed_usec)
+ *
+ *   For example, to see how long we hold up suspend:
+ *
+ *   bpftrace -e 'usdt:./xscreensaver-systemd:xscreensaver:sleep_done
+ *     /arg0/ { @usec = hist(arg1); }'
+ *
  * https://github.com/mato/xscreensaver-systemd
  */
 
@@ -150,515 +358,7256 @@
 #include <err.h>
 #include <poll.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <syslog.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <time.h>
 #include <sys/time.h>
 
+#ifdef HAVE_X11
+# include <X11/Xlib.h>
+# include <X11/Xatom.h>
+# include <X11/extensions/dpms.h>
+# include <X11/extensions/scrnsaver.h>
+#endif
+
 #ifdef HAVE_LIBSYSTEMD
 # include <systemd/sd-bus.h>
 
 #else   /* !HAVE_LIBSYSTEMD */
 
- /* This is a testing shim so that I can make sure this compiles.
-    I don't have access to any machine with libsystemd >= 221.
-    Only 219 is available on CentOS 7.7...
-  */
- typedef struct sd_bus sd_bus;
- typedef struct sd_bus_message sd_bus_message;
- typedef struct sd_bus_slot sd_bus_slot;
- typedef struct { char *message; } sd_bus_error;
- typedef int (*sd_bus_message_handler_t)
-   (sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
- #define SD_BUS_ERROR_NULL { 0 }
- static int sd_bus_message_read (sd_bus_message *m, char *types, ...)
-   { return -1; }
- static sd_bus_message *sd_bus_message_unref(sd_bus_message *m) { return 0; }
- static void sd_bus_error_free(sd_bus_error *e) { }
- static int sd_bus_call_method(sd_bus *bus, const char *destination,
-                               const char *path, const char *interface,
-                               const char *member, sd_bus_error *ret_error,
-                               sd_bus_message **reply, const char *types, ...)
-   { return -1; }
- static int sd_bus_open_user(sd_bus **ret) { return -1; }
- static int sd_bus_request_name(sd_bus *bus, const char *name, uint64_t flags)
-   { return -1; }
- static int sd_bus_open_system(sd_bus **ret) { return -1; }
- static int sd_bus_add_match(sd_bus *bus, sd_bus_slot **slot,
-                             const char *match,
-                             sd_bus_message_handler_t callback, void *userdata)
-   { return -1; }
- static int sd_bus_process(sd_bus *bus, sd_bus_message **r) { return -1; }
- static sd_bus *sd_bus_flush_close_unref(sd_bus *bus) { return 0; }
- static sd_bus_slot *sd_bus_slot_unref(sd_bus_slot *slot) { return 0; }
- static void sd_bus_message_ref(sd_bus_message *r) { }
- static int sd_bus_reply_method_return (sd_bus_message *call,
-                                        const char *types, ...) { return -1; }
- struct sd_bus_vtable { int x; };
- typedef struct sd_bus_vtable sd_bus_vtable;
-# define SD_BUS_VTABLE_START(_flags) { 0 }
-# define SD_BUS_VTABLE_END /**/
-# define SD_BUS_METHOD(_member, _signature, _result, _handler, _flags) { 0 }
- static int sd_bus_add_object_vtable(sd_bus *bus, sd_bus_slot **slot,
-                                     const char *path, const char *interface,
-                                     const sd_bus_vtable *vtable,
-                                     void *userdata) { return -1; }
- static void *sd_bus_slot_set_userdata(sd_bus_slot *s, void *d) { return 0; }
- static int sd_bus_get_fd(sd_bus *bus) { return -1; }
- static int sd_bus_get_events(sd_bus *bus) { return -1; }
- static int sd_bus_get_timeout (sd_bus *bus, uint64_t *u) { return -1; }
+ /* An in-memory stand-in for sd-bus.
 
-#endif /* !HAVE_LIBSYSTEMD */
+    This started as a testing shim so that I could make sure this compiles
+    without libsystemd >= 221 (only 219 is available on CentOS 7.7...).
+    It now actually works, well enough to drive the handlers below without
+    a dbus-daemon: see -bench.
 
-#include "queue.h"
-#include "version.h"
+    A "bus" is a queue of incoming messages plus the objects, matches and
+    filters registered on it.  sd_bus_process() pops one message and
+    dispatches it the way sd-bus would.  sd_bus_call_method() on one of
+    our own objects dispatches synchronously and returns the reply that
+    the handler sent; calls to logind are answered by a fake logind whose
+    "Inhibit" hands out a real pipe fd.  Only basic types are stored in
+    messages; anything appended inside a container is counted, not kept.
+  */
 
-static char *progname;
-static char *screensaver_version;
-static int verbose_p = 0;
+#include <dirent.h>
+#include <sys/eventfd.h>
+#ifdef __GLIBC__
+# include <malloc.h>
+#endif
 
-#define DBUS_CLIENT_NAME     "org.jwz.XScreenSaver"
-#define DBUS_SD_SERVICE_NAME "org.freedesktop.login1"
-#define DBUS_SD_OBJECT_PATH  "/org/freedesktop/login1"
-#define DBUS_SD_INTERFACE    "org.freedesktop.login1.Manager"
-#define DBUS_SD_METHOD       "Inhibit"
-#define DBUS_SD_METHOD_ARGS  "ssss"
-#define DBUS_SD_METHOD_WHAT  "sleep"
-#define DBUS_SD_METHOD_WHO   "xscreensaver"
-#define DBUS_SD_METHOD_WHY   "lock screen on suspend"
-#define DBUS_SD_METHOD_MODE  "delay"
+typedef struct sd_bus sd_bus;
+typedef struct sd_bus_message sd_bus_message;
+typedef struct sd_bus_slot sd_bus_slot;
+typedef struct sd_bus_creds sd_bus_creds;
+typedef struct {
+  const char *name;
+  const char *message;
+  int _need_free;
+} sd_bus_error;
+typedef int (*sd_bus_message_handler_t)
+  (sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 
-#define DBUS_SD_MATCH "type='signal'," \
-                      "interface='" DBUS_SD_INTERFACE "'," \
-                      "member='PrepareForSleep'"
+#define SD_BUS_ERROR_NULL { NULL, NULL, 0 }
+#define SD_BUS_ERROR_LIMITS_EXCEEDED "org.freedesktop.DBus.Error.LimitsExceeded"
+#define SD_BUS_CREDS_SESSION ((uint64_t) 1 << 18)
+#define SD_BUS_NAME_QUEUE ((uint64_t) 1 << 2)
+#define SD_BUS_CREDS_AUGMENT ((uint64_t) 1 << 63)
+#define SD_BUS_MESSAGE_METHOD_CALL   1
+#define SD_BUS_MESSAGE_METHOD_RETURN 2
+#define SD_BUS_MESSAGE_METHOD_ERROR  3
+#define SD_BUS_MESSAGE_SIGNAL        4
 
-#define DBUS_FDO_NAME          "org.freedesktop.ScreenSaver"
-#define DBUS_FDO_OBJECT_PATH   "/ScreenSaver"
-#define DBUS_FDO_OBJECT_PATH_2 "/org/freedesktop/ScreenSaver"
-#define DBUS_FDO_INTERFACE     "org.freedesktop.ScreenSaver"
+struct sd_bus_vtable {
+  int type;
+  const char *member;
+  const char *signature;
+  const char *result;
+  sd_bus_message_handler_t handler;
+};
+typedef struct sd_bus_vtable sd_bus_vtable;
+#define SD_BUS_VTABLE_UNPRIVILEGED 0
+#define SD_BUS_VTABLE_START(_flags) { 'S', NULL, NULL, NULL, NULL }
+#define SD_BUS_VTABLE_END           { 'E', NULL, NULL, NULL, NULL }
+#define SD_BUS_METHOD(_member, _signature, _result, _handler, _flags) \
+  { 'M', _member, _signature, _result, _handler }
 
-struct handler_ctx {
-  sd_bus *system_bus;
-  sd_bus_message *lock_message;
-  int lock_fd;
-  int is_inhibited;
+#define FAKE_MAX_ARGS 8
+#define FAKE_LOGIND_NAME "org.freedesktop.login1"
+#define FAKE_DAEMON_NAME "org.freedesktop.DBus"
+
+struct fake_arg {
+  char type;
+  union {
+    char *s;
+    uint32_t u;
+    int i;
+    uint64_t t;
+  } v;
 };
 
-static struct handler_ctx global_ctx = { NULL, NULL, -1 };
+struct sd_bus_message {
+  int ref;
+  int type;                     /* SD_BUS_MESSAGE_* */
+  sd_bus *bus;
+  char *path, *interface, *member, *sender;
+  char *error_name, *error_message;
+  struct fake_arg args[FAKE_MAX_ARGS];
+  int nargs;
+  int rpos;                     /* Read cursor */
+  int depth;                    /* Open containers while appending */
+  int nitems;                   /* Values appended inside containers */
+  sd_bus_error error;           /* For sd_bus_message_get_error() */
+  sd_bus_message_handler_t reply_callback;  /* From call_method_async */
+  void *reply_userdata;
+  sd_bus_message *next;         /* In the bus's incoming queue */
+};
 
-SLIST_HEAD(inhibit_head, inhibit_entry) inhibit_head =
-  SLIST_HEAD_INITIALIZER(inhibit_head);
+/* Everything that can be registered on a bus, and what a slot points to. */
+struct sd_bus_slot {
+  int kind;                     /* 'O'bject, 'M'atch or 'F'ilter */
+  sd_bus *bus;
+  char *path, *interface;       /* Objects */
+  const sd_bus_vtable *vtable;
+  char *m_type, *m_sender, *m_path, *m_interface, *m_member, *m_arg0;
+  sd_bus_message_handler_t callback;
+  void *userdata;
+  sd_bus_slot *next;
+};
 
-struct inhibit_entry {
-  uint32_t cookie;
-  SLIST_ENTRY(inhibit_entry) entries;
+struct sd_bus {
+  int ref;
+  int efd;                      /* Readable while messages are queued */
+  int system_p;
+  sd_bus_slot *slots;
+  sd_bus_message *head, *tail;
+  sd_bus_message *last_reply;   /* Most recent reply sent by a handler */
 };
 
-static void
-xscreensaver_command (const char *cmd)
+static long fake_messages = 0;  /* Live ones, for -soak */
+static char fake_logind_owner[16] = ":1.1";     /* Changes on restart */
+
+static char *
+fake_strdup (const char *s)
 {
-  char buf[1024];
-  int rc;
-  sprintf (buf, "xscreensaver-command %.100s -%.100s",
-           (verbose_p ? "-verbose" : "-quiet"),
-           cmd);
-  if (verbose_p)
-    warnx ("exec: %s", buf);
-  rc = system (buf);
-  if (rc == -1)
-    warnx ("exec failed: %s", buf);
-  else if (WEXITSTATUS(rc) != 0)
-    warnx ("exec: \"%s\" exited with status %d", buf, WEXITSTATUS(rc));
+  return s ? strdup (s) : NULL;
 }
 
+static sd_bus_message *
+fake_message_new (sd_bus *bus, int type, const char *path,
+                  const char *interface, const char *member)
+{
+  sd_bus_message *m = calloc (1, sizeof(*m));
+  fake_messages++;
+  m->ref = 1;
+  m->type = type;
+  m->bus = bus;
+  m->path = fake_strdup (path);
+  m->interface = fake_strdup (interface);
+  m->member = fake_strdup (member);
+  m->sender = fake_strdup (bus && bus->system_p ? fake_logind_owner
+                           : ":1.42");
+  return m;
+}
 
-static int
-xscreensaver_register_sleep_lock (struct handler_ctx *ctx)
+static sd_bus_message *
+sd_bus_message_ref (sd_bus_message *m)
 {
-  sd_bus_error error = SD_BUS_ERROR_NULL;
-  sd_bus_message *reply = NULL;
-  int fd = -1;
-  int rc = sd_bus_call_method (ctx->system_bus,
-                               DBUS_SD_SERVICE_NAME, DBUS_SD_OBJECT_PATH,
-                               DBUS_SD_INTERFACE, DBUS_SD_METHOD,
-                               &error, &reply,
-                               DBUS_SD_METHOD_ARGS,
-                               DBUS_SD_METHOD_WHAT, DBUS_SD_METHOD_WHO,
-                               DBUS_SD_METHOD_WHY, DBUS_SD_METHOD_MODE);
-  if (rc < 0)
-    {
-      warnx ("dbus: inhibit sleep failed: %s", error.message);
-      goto DONE;
-    }
+  if (m) m->ref++;
+  return m;
+}
 
-  /* Save the lock fd and explicitly take a ref to the lock message. */
-  rc = sd_bus_message_read (reply, "h", &fd);
-  if (rc < 0 || fd < 0)
+static sd_bus_message *
+sd_bus_message_unref (sd_bus_message *m)
+{
+  int i;
+  if (!m || --m->ref > 0)
+    return NULL;
+  for (i = 0; i < m->nargs; i++)
+    if (m->args[i].type == 's' || m->args[i].type == 'o')
+      free (m->args[i].v.s);
+  free (m->path);
+  free (m->interface);
+  free (m->member);
+  free (m->sender);
+  free (m->error_name);
+  free (m->error_message);
+  free (m);
+  fake_messages--;
+  return NULL;
+}
+
+static int
+fake_append_v (sd_bus_message *m, const char *types, va_list *ap)
+{
+  const char *t;
+  for (t = types; *t; t++)
     {
-      warnx ("dbus: inhibit sleep failed: no lock fd: %s", strerror(-rc));
-      goto DONE;
+      struct fake_arg a;
+      a.type = *t;
+      switch (*t)
+        {
+        case '(': case ')': case '{': case '}':
+          continue;
+        case 's': case 'o':
+          a.v.s = va_arg (*ap, char *);
+          break;
+        case 'u':
+          a.v.u = va_arg (*ap, uint32_t);
+          break;
+        case 'b': case 'h': case 'i':
+          a.v.i = va_arg (*ap, int);
+          break;
+        case 't':
+          a.v.t = va_arg (*ap, uint64_t);
+          break;
+        default:
+          return -EINVAL;
+        }
+      if (m->depth > 0)
+        {
+          m->nitems++;
+          continue;
+        }
+      if (m->nargs >= FAKE_MAX_ARGS)
+        return -E2BIG;
+      if (a.type == 's' || a.type == 'o')
+        a.v.s = strdup (a.v.s ? a.v.s : "");
+      m->args[m->nargs++] = a;
     }
-  sd_bus_message_ref(reply);
-  ctx->lock_message = reply;
-  ctx->lock_fd = fd;
-
- DONE:
-  sd_bus_error_free (&error);
+  return 0;
+}
 
+static int
+sd_bus_message_append (sd_bus_message *m, const char *types, ...)
+{
+  va_list ap;
+  int rc;
+  va_start (ap, types);
+  rc = fake_append_v (m, types, &ap);
+  va_end (ap);
   return rc;
 }
 
+static int
+sd_bus_message_open_container (sd_bus_message *m, char type,
+                               const char *contents)
+{
+  m->depth++;
+  return 0;
+}
 
-/* Called when DBUS_SD_INTERFACE sends a "PrepareForSleep" signal.
-   The event is sent twice: before sleep, and after.
- */
 static int
-xscreensaver_systemd_handler (sd_bus_message *m, void *arg,
-                              sd_bus_error *ret_error)
+sd_bus_message_close_container (sd_bus_message *m)
 {
-  struct handler_ctx *ctx = arg;
-  int before_sleep;
-  int rc;
+  if (m->depth <= 0)
+    return -EINVAL;
+  m->depth--;
+  return 0;
+}
 
-  rc = sd_bus_message_read (m, "b", &before_sleep);
-  if (rc < 0)
-    {
-      warnx ("dbus: message read failed: %s", strerror(-rc));
-      return 1;  /* >= 0 means success */
-    }
+/* Returns 1 per value read, 0 at the end of the message. */
+static int
+sd_bus_message_read (sd_bus_message *m, const char *types, ...)
+{
+  va_list ap;
+  const char *t;
+  int rc = 1;
 
-  /* Use the scheme described at
-     https://www.freedesktop.org/wiki/Software/systemd/inhibit/
-     under "Taking Delay Locks".
-   */
-  if (before_sleep)
+  va_start (ap, types);
+  for (t = types; *t; t++)
     {
-      /* Tell xscreensaver that we are suspending, and to lock if desired. */
-      xscreensaver_command ("suspend");
-
-      if (ctx->lock_message)
+      struct fake_arg *a;
+      if (m->rpos >= m->nargs)
         {
-          /* Release the lock, meaning we are done and it's ok to sleep now.
-             Don't rely on unref'ing the message to close the fd, do that
-             explicitly here.
-           */
-          close(ctx->lock_fd);
-          sd_bus_message_unref (ctx->lock_message);
-          ctx->lock_message = NULL;
-          ctx->lock_fd = -1;
+          rc = 0;
+          break;
         }
-      else
+      a = &m->args[m->rpos];
+      if (a->type != *t)
+        {
+          rc = -ENXIO;
+          break;
+        }
+      m->rpos++;
+      switch (*t)
         {
-          warnx ("dbus: no context lock");
+        case 's': case 'o':
+          *va_arg (ap, const char **) = a->v.s;
+          break;
+        case 'u':
+          *va_arg (ap, uint32_t *) = a->v.u;
+          break;
+        case 'b': case 'h': case 'i':
+          *va_arg (ap, int *) = a->v.i;
+          break;
+        case 't':
+          *va_arg (ap, uint64_t *) = a->v.t;
+          break;
         }
     }
-  else
-    {
-      /* Tell xscreensaver to present the unlock dialog right now. */
-      xscreensaver_command ("deactivate");
+  va_end (ap);
+  return rc;
+}
 
-      /* We woke from sleep, so we need to re-register for the next sleep. */
-      rc = xscreensaver_register_sleep_lock (ctx);
-      if (rc < 0)
-        warnx("could not re-register sleep lock");
-    }
+/* No containers are ever stored, so there is never anything inside. */
+static int
+sd_bus_message_enter_container (sd_bus_message *m, char type,
+                                const char *contents)
+{
+  return 0;
+}
 
-  return 1;  /* >= 0 means success */
+static int
+sd_bus_message_exit_container (sd_bus_message *m)
+{
+  return 1;
 }
 
-static uint32_t
-xscreensaver_get_cookie(void)
+static int
+sd_bus_message_is_method_error (sd_bus_message *m, const char *name)
 {
-    uint32_t cookie = 0;
-    static int use_rand48 = 0;
-    int rc;
+  return (m->type == SD_BUS_MESSAGE_METHOD_ERROR &&
+          (!name || (m->error_name && !strcmp (name, m->error_name))));
+}
 
-    if (use_rand48)
-      {
-        cookie = lrand48();
-      }
-    else
-      {
-        /* According to the manpage may fail with ENOSYS on some kernels,
-           so just fall back to lrand48() if that (or any other failure)
-           happens. */
-        rc = getentropy(&cookie, sizeof cookie);
-        if (rc != 0)
-          {
-            warn("getentropy() failed, falling back to lrand48()");
-            srand48(time(NULL));
-            use_rand48 = 1;
-            cookie = lrand48();
-          }
-      }
-    return cookie;
+static const sd_bus_error *
+sd_bus_message_get_error (sd_bus_message *m)
+{
+  if (m->type != SD_BUS_MESSAGE_METHOD_ERROR)
+    return NULL;
+  m->error.name = m->error_name;
+  m->error.message = m->error_message;
+  return &m->error;
 }
 
 static int
-xscreensaver_method_inhibit(sd_bus_message *m, void *arg,
-                            sd_bus_error *ret_error)
+sd_bus_message_get_errno (sd_bus_message *m)
 {
-    struct handler_ctx *ctx = arg;
-    char *application_name, *inhibit_reason;
-    struct inhibit_entry *entry;
+  return m->type == SD_BUS_MESSAGE_METHOD_ERROR ? EIO : 0;
+}
 
-    int rc = sd_bus_message_read(m, "ss", &application_name, &inhibit_reason);
-    if (rc < 0) {
-        warnx("Failed to parse method call: %s", strerror(-rc));
-        return rc;
-    }
+static const char *
+sd_bus_message_get_sender (sd_bus_message *m) { return m->sender; }
+static const char *
+sd_bus_message_get_member (sd_bus_message *m) { return m->member; }
+static const char *
+sd_bus_message_get_path (sd_bus_message *m) { return m->path; }
+static sd_bus *
+sd_bus_message_get_bus (sd_bus_message *m) { return m->bus; }
 
-    entry = malloc(sizeof (struct inhibit_entry));
-    entry->cookie = xscreensaver_get_cookie();
-    SLIST_INSERT_HEAD(&inhibit_head, entry, entries);
-    ctx->is_inhibited++;
-    if (verbose_p)
-      warnx("Inhibit() called: Application: '%s': Reason: '%s' -> returning %u",
-          application_name,
-          inhibit_reason,
-          entry->cookie);
+static int
+sd_bus_message_new_method_return (sd_bus_message *call, sd_bus_message **m)
+{
+  *m = fake_message_new (call->bus, SD_BUS_MESSAGE_METHOD_RETURN,
+                         NULL, NULL, NULL);
+  return 0;
+}
 
-    return sd_bus_reply_method_return(m, "u", entry->cookie);
+static void
+fake_set_reply (sd_bus *bus, sd_bus_message *reply)
+{
+  sd_bus_message_unref (bus->last_reply);
+  bus->last_reply = sd_bus_message_ref (reply);
 }
 
 static int
-xscreensaver_method_uninhibit(sd_bus_message *m, void *arg,
-                              sd_bus_error *ret_error)
+sd_bus_send (sd_bus *bus, sd_bus_message *m, uint64_t *cookie)
 {
-    struct handler_ctx *ctx = arg;
-    uint32_t cookie;
-    struct inhibit_entry *entry;
-    int found = 0;
-
-    int rc = sd_bus_message_read(m, "u", &cookie);
-    if (rc < 0) {
-        warnx("Failed to parse method call: %s", strerror(-rc));
-        return rc;
-    }
+  if (!bus)
+    bus = m->bus;
+  if (m->type == SD_BUS_MESSAGE_METHOD_RETURN ||
+      m->type == SD_BUS_MESSAGE_METHOD_ERROR)
+    fake_set_reply (bus, m);
+  /* Anything else would go out to other peers; there are none. */
+  return 1;
+}
 
-    SLIST_FOREACH(entry, &inhibit_head, entries)
-      {
-        if (entry->cookie == cookie)
-          {
-            SLIST_REMOVE(&inhibit_head, entry, inhibit_entry, entries);
-            free(entry);
-            ctx->is_inhibited--;
-            if (ctx->is_inhibited < 0)
-              ctx->is_inhibited = 0;
-            found = 1;
-            break;
-          }
-      }
-    if (verbose_p)
-      warnx("UnInhibit() called: Cookie: %u%s",
-          cookie,
-          found ? ": Removed" : ": Not found, ignored");
+static int
+sd_bus_reply_method_return (sd_bus_message *call, const char *types, ...)
+{
+  sd_bus_message *reply;
+  va_list ap;
+  int rc;
 
-    return sd_bus_reply_method_return(m, "");
+  sd_bus_message_new_method_return (call, &reply);
+  va_start (ap, types);
+  rc = fake_append_v (reply, types, &ap);
+  va_end (ap);
+  if (rc >= 0)
+    rc = sd_bus_send (NULL, reply, NULL);
+  sd_bus_message_unref (reply);
+  return rc;
 }
 
-/*
- * This vtable defines the service interface we implement.
- */
-static const sd_bus_vtable
-xscreensaver_dbus_vtable[] = {
-    SD_BUS_VTABLE_START(0),
-    SD_BUS_METHOD("Inhibit", "ss", "u", xscreensaver_method_inhibit,
-                  SD_BUS_VTABLE_UNPRIVILEGED),
-    SD_BUS_METHOD("UnInhibit", "u", "", xscreensaver_method_uninhibit,
-                  SD_BUS_VTABLE_UNPRIVILEGED),
-    SD_BUS_VTABLE_END
-};
-
+static void sd_bus_error_free (sd_bus_error *e) { }
 
+/* Signals we send would go to other peers; there are none. */
 static int
-xscreensaver_systemd_loop (void)
+sd_bus_emit_signal (sd_bus *bus, const char *path, const char *interface,
+                    const char *member, const char *types, ...)
 {
-  sd_bus *system_bus = NULL, *user_bus = NULL;
-  struct handler_ctx *ctx = &global_ctx;
-  sd_bus_error error = SD_BUS_ERROR_NULL;
-  int rc;
-  time_t last_deactivate_time = 0, now;
+  return 1;
+}
 
-  /* 'user_bus' is where we receive messages from other programs sending
-     inhibit/uninhibit to org.freedesktop.ScreenSaver, etc.
-   */
+static int
+fake_bus_open (sd_bus **ret, int system_p)
+{
+  sd_bus *bus = calloc (1, sizeof(*bus));
+  bus->ref = 1;
+  bus->system_p = system_p;
+  bus->efd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  *ret = bus;
+  return 0;
+}
 
-  rc = sd_bus_open_user (&user_bus);
-  if (rc < 0) {
-    warnx ("dbus: connection failed: %s", strerror(-rc));
-    goto FAIL;
-  }
+static int sd_bus_open_user (sd_bus **ret) { return fake_bus_open (ret, 0); }
+static int sd_bus_open_system (sd_bus **ret) { return fake_bus_open(ret, 1); }
 
-  rc = sd_bus_add_object_vtable(user_bus,
-                                NULL,
-                                DBUS_FDO_OBJECT_PATH,
-                                DBUS_FDO_INTERFACE,
-                                xscreensaver_dbus_vtable,
-                                &global_ctx);
-  if (rc < 0) {
-    warnx("dbus: vtable registration failed: %s", strerror(-rc));
-    goto FAIL;
-  }
+/* Set while some other copy holds every name, as for -standby. */
+static int fake_names_taken = 0;
+
+static int
+sd_bus_request_name (sd_bus *bus, const char *name, uint64_t flags)
+{
+  if (!fake_names_taken)
+    return 1;
+  return (flags & SD_BUS_NAME_QUEUE) ? 0 : -EEXIST;
+}
+
+static int
+sd_bus_release_name (sd_bus *bus, const char *name)
+{
+  return 1;
+}
+
+static int
+sd_bus_error_set (sd_bus_error *e, const char *name, const char *message)
+{
+  if (e)
+    {
+      e->name = name;
+      e->message = message;
+    }
+  return -EIO;
+}
+
+static void
+fake_slot_free (sd_bus_slot *slot)
+{
+  free (slot->path);
+  free (slot->interface);
+  free (slot->m_type);
+  free (slot->m_sender);
+  free (slot->m_path);
+  free (slot->m_interface);
+  free (slot->m_member);
+  free (slot->m_arg0);
+  free (slot);
+}
+
+static sd_bus_slot *
+fake_slot_add (sd_bus *bus, sd_bus_slot **ret, int kind,
+               sd_bus_message_handler_t callback, void *userdata)
+{
+  sd_bus_slot *slot = calloc (1, sizeof(*slot));
+  sd_bus_slot **tail;
+  slot->kind = kind;
+  slot->bus = bus;
+  slot->callback = callback;
+  slot->userdata = userdata;
+  /* Keep registration order: filters run in the order they were added. */
+  for (tail = &bus->slots; *tail; tail = &(*tail)->next)
+    ;
+  *tail = slot;
+  if (ret)
+    *ret = slot;
+  return slot;
+}
+
+static sd_bus_slot *
+sd_bus_slot_unref (sd_bus_slot *slot)
+{
+  sd_bus_slot **p;
+  if (!slot)
+    return NULL;
+  for (p = &slot->bus->slots; *p; p = &(*p)->next)
+    if (*p == slot)
+      {
+        *p = slot->next;
+        break;
+      }
+  fake_slot_free (slot);
+  return NULL;
+}
+
+static int
+sd_bus_add_object_vtable (sd_bus *bus, sd_bus_slot **ret, const char *path,
+                          const char *interface, const sd_bus_vtable *vtable,
+                          void *userdata)
+{
+  sd_bus_slot *slot = fake_slot_add (bus, ret, 'O', NULL, userdata);
+  slot->path = strdup (path);
+  slot->interface = strdup (interface);
+  slot->vtable = vtable;
+  return 0;
+}
+
+static int
+sd_bus_add_filter (sd_bus *bus, sd_bus_slot **ret,
+                   sd_bus_message_handler_t callback, void *userdata)
+{
+  fake_slot_add (bus, ret, 'F', callback, userdata);
+  return 0;
+}
+
+/* Pull the value of key='value' out of a match rule, if it is there. */
+static char *
+fake_match_get (const char *match, const char *key)
+{
+  size_t L = strlen (key);
+  const char *s = match;
+  while ((s = strstr (s, key)))
+    {
+      if ((s == match || s[-1] == ',') && s[L] == '=' && s[L+1] == '\'')
+        {
+          const char *v = s + L + 2;
+          const char *e = strchr (v, '\'');
+          char *ret;
+          if (!e) return NULL;
+          ret = malloc (e - v + 1);
+          memcpy (ret, v, e - v);
+          ret[e - v] = 0;
+          return ret;
+        }
+      s += L;
+    }
+  return NULL;
+}
+
+static int
+sd_bus_add_match (sd_bus *bus, sd_bus_slot **ret, const char *match,
+                  sd_bus_message_handler_t callback, void *userdata)
+{
+  sd_bus_slot *slot = fake_slot_add (bus, ret, 'M', callback, userdata);
+  slot->m_type      = fake_match_get (match, "type");
+  slot->m_sender    = fake_match_get (match, "sender");
+  slot->m_path      = fake_match_get (match, "path");
+  slot->m_interface = fake_match_get (match, "interface");
+  slot->m_member    = fake_match_get (match, "member");
+  slot->m_arg0      = fake_match_get (match, "arg0");
+  return 0;
+}
+
+static int
+fake_streq (const char *want, const char *have)
+{
+  return !want || (have && !strcmp (want, have));
+}
+
+static int
+fake_match_p (const sd_bus_slot *slot, const sd_bus_message *m)
+{
+  if (slot->m_type && strcmp (slot->m_type, "signal"))
+    return 0;
+  return (m->type == SD_BUS_MESSAGE_SIGNAL &&
+          fake_streq (slot->m_sender, m->sender) &&
+          fake_streq (slot->m_path, m->path) &&
+          fake_streq (slot->m_interface, m->interface) &&
+          fake_streq (slot->m_member, m->member) &&
+          (!slot->m_arg0 ||
+           (m->nargs > 0 && (m->args[0].type == 's') &&
+            !strcmp (slot->m_arg0, m->args[0].v.s))));
+}
+
+/* Run a method call against our own objects, as the bus would deliver it.
+   Returns 1 if a handler was found.
+ */
+static int
+fake_dispatch_call (sd_bus *bus, sd_bus_message *m)
+{
+  sd_bus_slot *slot;
+  for (slot = bus->slots; slot; slot = slot->next)
+    {
+      const sd_bus_vtable *v;
+      if (slot->kind != 'O' ||
+          strcmp (slot->path, m->path) ||
+          strcmp (slot->interface, m->interface))
+        continue;
+      for (v = slot->vtable; v->type != 'E'; v++)
+        if (v->type == 'M' && !strcmp (v->member, m->member))
+          {
+            sd_bus_error error = SD_BUS_ERROR_NULL;
+            int rc = v->handler (m, slot->userdata, &error);
+            if (rc < 0)
+              {
+                sd_bus_message *reply =
+                  fake_message_new (bus, SD_BUS_MESSAGE_METHOD_ERROR,
+                                    NULL, NULL, NULL);
+                reply->error_name = fake_strdup (error.name
+                                                 ? error.name
+                                                 : "org.freedesktop.DBus."
+                                                   "Error.Failed");
+                reply->error_message = fake_strdup (error.message);
+                fake_set_reply (bus, reply);
+                sd_bus_message_unref (reply);
+              }
+            return 1;
+          }
+    }
+  return 0;
+}
+
+static void
+fake_dispatch (sd_bus *bus, sd_bus_message *m)
+{
+  sd_bus_slot *slot, *next;
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+
+  /* As in sd-bus, replies go to their callback before any filter. */
+  if (m->reply_callback)
+    {
+      m->reply_callback (m, m->reply_userdata, &error);
+      return;
+    }
+
+  for (slot = bus->slots; slot; slot = next)
+    {
+      next = slot->next;
+      if (slot->kind == 'F' && slot->callback (m, slot->userdata, &error) > 0)
+        return;
+    }
+
+  if (m->type == SD_BUS_MESSAGE_METHOD_CALL)
+    fake_dispatch_call (bus, m);
+  else
+    for (slot = bus->slots; slot; slot = next)
+      {
+        next = slot->next;
+        if (slot->kind == 'M' && fake_match_p (slot, m))
+          slot->callback (m, slot->userdata, &error);
+      }
+}
+
+static int
+sd_bus_process (sd_bus *bus, sd_bus_message **r)
+{
+  sd_bus_message *m = bus->head;
+  uint64_t junk;
+
+  if (r) *r = NULL;
+  if (!m)
+    {
+      if (read (bus->efd, &junk, sizeof(junk)) < 0 && errno != EAGAIN)
+        return -errno;
+      return 0;
+    }
+  bus->head = m->next;
+  if (!bus->head)
+    bus->tail = NULL;
+  m->next = NULL;
+  fake_dispatch (bus, m);
+  sd_bus_message_unref (m);
+  return 1;
+}
+
+/* Put a message on a bus's incoming queue, as if a peer had sent it. */
+static void
+fake_bus_enqueue (sd_bus *bus, sd_bus_message *m)
+{
+  uint64_t one = 1;
+  if (bus->tail)
+    bus->tail->next = m;
+  else
+    bus->head = m;
+  bus->tail = m;
+  if (write (bus->efd, &one, sizeof(one)) < 0)
+    ;  /* Counter overflow: it is readable anyway */
+}
+
+/* Queue an incoming signal, e.g. logind's PrepareForSleep. */
+static int
+fake_bus_signal_v (sd_bus *bus, const char *sender, const char *path,
+                   const char *interface, const char *member,
+                   const char *types, va_list *ap)
+{
+  sd_bus_message *m = fake_message_new (bus, SD_BUS_MESSAGE_SIGNAL,
+                                        path, interface, member);
+  int rc = fake_append_v (m, types, ap);
+  if (rc < 0)
+    {
+      sd_bus_message_unref (m);
+      return rc;
+    }
+  if (sender)
+    {
+      free (m->sender);
+      m->sender = strdup (sender);
+    }
+  fake_bus_enqueue (bus, m);
+  return 0;
+}
+
+/* A signal from logind on the system bus, or from us on the user bus. */
+static int
+fake_bus_signal (sd_bus *bus, const char *path, const char *interface,
+                 const char *member, const char *types, ...)
+{
+  va_list ap;
+  int rc;
+  va_start (ap, types);
+  rc = fake_bus_signal_v (bus, NULL, path, interface, member, types, &ap);
+  va_end (ap);
+  return rc;
+}
+
+/* The same, from somebody else. */
+static int
+fake_bus_signal_from (sd_bus *bus, const char *sender, const char *path,
+                      const char *interface, const char *member,
+                      const char *types, ...)
+{
+  va_list ap;
+  int rc;
+  va_start (ap, types);
+  rc = fake_bus_signal_v (bus, sender, path, interface, member, types, &ap);
+  va_end (ap);
+  return rc;
+}
+
+/* logind going away and coming back with a new unique name, as after
+   "systemctl restart systemd-logind". */
+static void
+fake_logind_restart (sd_bus *bus)
+{
+  static int serial = 100;
+  char old[sizeof(fake_logind_owner)];
+
+  strcpy (old, fake_logind_owner);
+  sprintf (fake_logind_owner, ":1.%d", serial++);
+  fake_bus_signal_from (bus, FAKE_DAEMON_NAME, "/org/freedesktop/DBus",
+                        FAKE_DAEMON_NAME, "NameOwnerChanged", "sss",
+                        FAKE_LOGIND_NAME, old, "");
+  fake_bus_signal_from (bus, FAKE_DAEMON_NAME, "/org/freedesktop/DBus",
+                        FAKE_DAEMON_NAME, "NameOwnerChanged", "sss",
+                        FAKE_LOGIND_NAME, "", fake_logind_owner);
+}
+
+/* Set from PrepareForSleep(true) until PrepareForSleep(false): while the
+   sleep job runs, logind turns away any Inhibit for "sleep". */
+static int fake_logind_sleeping = 0;
+
+/* logind announcing a sleep, or the end of one. */
+static void
+fake_logind_sleep (sd_bus *bus, int before_sleep)
+{
+  fake_logind_sleeping = before_sleep;
+  fake_bus_signal (bus, "/org/freedesktop/login1", FAKE_LOGIND_NAME ".Manager",
+                   "PrepareForSleep", "b", before_sleep);
+}
+
+/* What logind would say.  Only Inhibit succeeds: it returns the read end
+   of a fresh pipe, whose write end is already closed, so the caller can
+   close it whenever it likes and nothing leaks.
+ */
+static int
+fake_logind (sd_bus *bus, sd_bus_message *call, sd_bus_error *error,
+             sd_bus_message **reply)
+{
+  if (!strcmp (call->member, "SetIdleHint"))
+    {
+      *reply = fake_message_new (bus, SD_BUS_MESSAGE_METHOD_RETURN,
+                                 NULL, NULL, NULL);
+      return 0;
+    }
+  if (!strcmp (call->member, "Inhibit") && fake_logind_sleeping)
+    {
+      if (error)
+        error->message = "The operation inhibition has been requested for "
+                         "is already running";
+      return -EBUSY;
+    }
+  if (!strcmp (call->member, "Inhibit"))
+    {
+      int fds[2];
+      if (pipe (fds) < 0)
+        return -errno;
+      close (fds[1]);
+      *reply = fake_message_new (bus, SD_BUS_MESSAGE_METHOD_RETURN,
+                                 NULL, NULL, NULL);
+      return sd_bus_message_append (*reply, "h", fds[0]);
+    }
+  if (error)
+    error->message = "not implemented by the fake logind";
+  return -ENOENT;
+}
+
+/* What the bus itself would say.  Only logind has a name on it. */
+static int
+fake_daemon (sd_bus *bus, sd_bus_message *call, sd_bus_error *error,
+             sd_bus_message **reply)
+{
+  if (!strcmp (call->member, "GetNameOwner") && call->nargs == 1 &&
+      bus->system_p && !strcmp (call->args[0].v.s, FAKE_LOGIND_NAME))
+    {
+      *reply = fake_message_new (bus, SD_BUS_MESSAGE_METHOD_RETURN,
+                                 NULL, NULL, NULL);
+      return sd_bus_message_append (*reply, "s", fake_logind_owner);
+    }
+  if (error)
+    error->message = "no such name";
+  return -ENXIO;
+}
+
+static int
+fake_call_v (sd_bus *bus, const char *destination, const char *path,
+             const char *interface, const char *member,
+             sd_bus_error *ret_error, sd_bus_message **reply,
+             const char *types, va_list *ap)
+{
+  sd_bus_message *m = fake_message_new (bus, SD_BUS_MESSAGE_METHOD_CALL,
+                                        path, interface, member);
+  sd_bus_message *r = NULL;
+  int rc;
+
+  rc = fake_append_v (m, types, ap);
+  if (rc < 0)
+    goto DONE;
+
+  if (destination && !strcmp (destination, FAKE_LOGIND_NAME))
+    rc = fake_logind (bus, m, ret_error, &r);
+  else if (destination && !strcmp (destination, FAKE_DAEMON_NAME))
+    rc = fake_daemon (bus, m, ret_error, &r);
+  else
+    {
+      fake_set_reply (bus, NULL);
+      if (!fake_dispatch_call (bus, m))
+        rc = -EBADR;
+      else if (!bus->last_reply)
+        rc = -ENOMSG;
+      else if (bus->last_reply->type == SD_BUS_MESSAGE_METHOD_ERROR)
+        {
+          if (ret_error)
+            ret_error->message = "method call failed";
+          rc = -EIO;
+        }
+      else
+        r = sd_bus_message_ref (bus->last_reply);
+      fake_set_reply (bus, NULL);
+    }
+
+ DONE:
+  sd_bus_message_unref (m);
+  if (rc >= 0 && reply)
+    *reply = r;
+  else
+    sd_bus_message_unref (r);
+  return rc < 0 ? rc : 1;
+}
+
+static int
+sd_bus_call_method (sd_bus *bus, const char *destination, const char *path,
+                    const char *interface, const char *member,
+                    sd_bus_error *ret_error, sd_bus_message **reply,
+                    const char *types, ...)
+{
+  va_list ap;
+  int rc;
+  va_start (ap, types);
+  rc = fake_call_v (bus, destination, path, interface, member, ret_error,
+                    reply, types, &ap);
+  va_end (ap);
+  return rc;
+}
+
+/* The call is made at once, but its reply is queued, so the callback
+   runs from a later sd_bus_process() just as it would for real.  Only
+   floating calls: 'slot' always comes back NULL.
+ */
+static int
+sd_bus_call_method_async (sd_bus *bus, sd_bus_slot **slot,
+                          const char *destination, const char *path,
+                          const char *interface, const char *member,
+                          sd_bus_message_handler_t callback, void *userdata,
+                          const char *types, ...)
+{
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *r = NULL;
+  va_list ap;
+  int rc;
+
+  va_start (ap, types);
+  rc = fake_call_v (bus, destination, path, interface, member, &error, &r,
+                    types, &ap);
+  va_end (ap);
+  if (rc < 0)
+    {
+      r = fake_message_new (bus, SD_BUS_MESSAGE_METHOD_ERROR,
+                            NULL, NULL, NULL);
+      r->error_name = fake_strdup ("org.freedesktop.DBus.Error.Failed");
+      r->error_message = fake_strdup (error.message ? error.message
+                                      : strerror (-rc));
+    }
+  r->reply_callback = callback;
+  r->reply_userdata = userdata;
+  fake_bus_enqueue (bus, r);
+  if (slot)
+    *slot = NULL;
+  return 1;
+}
+
+static int
+sd_bus_get_property (sd_bus *bus, const char *destination, const char *path,
+                     const char *interface, const char *member,
+                     sd_bus_error *ret_error, sd_bus_message **reply,
+                     const char *type)
+{
+  return -ENOENT;
+}
+
+static int
+sd_bus_get_property_string (sd_bus *bus, const char *destination,
+                            const char *path, const char *interface,
+                            const char *member, sd_bus_error *ret_error,
+                            char **ret)
+{
+  return -ENOENT;
+}
+
+static int
+sd_bus_get_property_trivial (sd_bus *bus, const char *destination,
+                             const char *path, const char *interface,
+                             const char *member, sd_bus_error *ret_error,
+                             char type, void *ret)
+{
+  return -ENOENT;
+}
+
+static int
+sd_bus_message_skip (sd_bus_message *m, const char *types)
+{
+  m->rpos += strlen (types);
+  return 1;
+}
+
+static int
+sd_bus_query_sender_creds (sd_bus_message *m, uint64_t mask,
+                           sd_bus_creds **creds)
+{
+  return -ENODATA;
+}
+static int
+sd_bus_creds_get_session (sd_bus_creds *c, const char **id)
+{
+  return -ENODATA;
+}
+static sd_bus_creds *sd_bus_creds_unref (sd_bus_creds *c) { return NULL; }
+
+static int sd_bus_get_fd (sd_bus *bus) { return bus->efd; }
+static int sd_bus_get_events (sd_bus *bus) { return POLLIN; }
+
+static int
+sd_bus_get_timeout (sd_bus *bus, uint64_t *u)
+{
+  *u = bus->head ? 0 : UINT64_MAX;
+  return 1;
+}
+
+static sd_bus *
+sd_bus_flush_close_unref (sd_bus *bus)
+{
+  sd_bus_message *m;
+  sd_bus_slot *slot;
+
+  if (!bus || --bus->ref > 0)
+    return NULL;
+  while ((m = bus->head))
+    {
+      bus->head = m->next;
+      sd_bus_message_unref (m);
+    }
+  while ((slot = bus->slots))
+    {
+      bus->slots = slot->next;
+      fake_slot_free (slot);
+    }
+  sd_bus_message_unref (bus->last_reply);
+  close (bus->efd);
+  free (bus);
+  return NULL;
+}
+
+#endif /* !HAVE_LIBSYSTEMD */
+
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+# define TRACE1(name,a)          DTRACE_PROBE1(xscreensaver,name,a)
+# define TRACE2(name,a,b)        DTRACE_PROBE2(xscreensaver,name,a,b)
+# define TRACE3(name,a,b,c)      DTRACE_PROBE3(xscreensaver,name,a,b,c)
+# define TRACE4(name,a,b,c,d)    DTRACE_PROBE4(xscreensaver,name,a,b,c,d)
+#else
+# define TRACE1(name,a)          do { (void) sizeof (a); } while (0)
+# define TRACE2(name,a,b)        do { (void) sizeof (b); } while (0)
+# define TRACE3(name,a,b,c)      do { (void) sizeof (c); } while (0)
+# define TRACE4(name,a,b,c,d)    do { (void) sizeof (d); } while (0)
+#endif
+
+#include "queue.h"
+#include "version.h"
+
+static char *progname;
+static char *screensaver_version;
+static int verbose_p = 0;
+static int log_level = LOG_NOTICE;
+static int spawn_helper_p = 0;
+static int private_bus_p = 0;  /* Use the session bus as the system bus */
+static int dry_run_p = 0;      /* Account for commands, but don't run them */
+static int inhibit_only_p = 0; /* Serve inhibitors, but take no sleep lock */
+static int no_inhibit_p = 0;   /* Take the sleep lock, but no user bus */
+static int standby_p = 0;      /* Queue for our names if they are taken */
+static int session_manager_p = 0; /* Also serve the GNOME and MATE names */
+
+/* With -inhibit-only, how long to stay around with nothing to do. */
+#define IDLE_EXIT_SECS 120
+
+#define DBUS_CLIENT_NAME     "org.jwz.XScreenSaver"
+#define DBUS_CLIENT_OBJECT_PATH     "/org/jwz/XScreenSaver"
+#define DBUS_CLIENT_STATS_INTERFACE "org.jwz.XScreenSaver.Stats"
+#define DBUS_CLIENT_INHIBIT_INTERFACE "org.jwz.XScreenSaver.Inhibit"
+#define DBUS_SD_SERVICE_NAME "org.freedesktop.login1"
+#define DBUS_SD_OBJECT_PATH  "/org/freedesktop/login1"
+#define DBUS_SD_INTERFACE    "org.freedesktop.login1.Manager"
+#define DBUS_SD_METHOD       "Inhibit"
+#define DBUS_SD_METHOD_ARGS  "ssss"
+#define DBUS_SD_METHOD_WHAT  "sleep"
+#define DBUS_SD_METHOD_WHO   "xscreensaver"
+#define DBUS_SD_METHOD_WHY   "lock screen on suspend"
+#define DBUS_SD_METHOD_MODE  "delay"
+#define DBUS_SD_SHUTDOWN_WHAT "shutdown"
+#define DBUS_SD_SHUTDOWN_WHY  "lock screen on shutdown"
+
+/* Signals from logind are also matched on its unique name, which is put
+   in front of these: see xscreensaver_logind_watch(). */
+#define DBUS_SD_MATCH "type='signal'," \
+                      "path='" DBUS_SD_OBJECT_PATH "'," \
+                      "interface='" DBUS_SD_INTERFACE "'," \
+                      "member='PrepareForSleep'"
+
+#define DBUS_SD_SHUTDOWN_MATCH "type='signal'," \
+                      "path='" DBUS_SD_OBJECT_PATH "'," \
+                      "interface='" DBUS_SD_INTERFACE "'," \
+                      "member='PrepareForShutdown'"
+
+#define DBUS_SD_SESSION_INTERFACE "org.freedesktop.login1.Session"
+
+/* One match each for every session's Lock and Unlock: the handler picks
+   the session by object path. */
+#define DBUS_SD_LOCK_MATCH "type='signal'," \
+                      "path_namespace='" DBUS_SD_OBJECT_PATH "/session'," \
+                      "interface='" DBUS_SD_SESSION_INTERFACE "'," \
+                      "member='Lock'"
+#define DBUS_SD_UNLOCK_MATCH "type='signal'," \
+                      "path_namespace='" DBUS_SD_OBJECT_PATH "/session'," \
+                      "interface='" DBUS_SD_SESSION_INTERFACE "'," \
+                      "member='Unlock'"
+#define DBUS_SD_SESSION_NEW_MATCH "type='signal'," \
+                      "path='" DBUS_SD_OBJECT_PATH "'," \
+                      "interface='" DBUS_SD_INTERFACE "'," \
+                      "member='SessionNew'"
+#define DBUS_SD_SESSION_REMOVED_MATCH "type='signal'," \
+                      "path='" DBUS_SD_OBJECT_PATH "'," \
+                      "interface='" DBUS_SD_INTERFACE "'," \
+                      "member='SessionRemoved'"
+
+/* Who owns logind's name.  This one comes from the bus itself. */
+#define DBUS_DAEMON_NAME        "org.freedesktop.DBus"
+#define DBUS_DAEMON_OBJECT_PATH "/org/freedesktop/DBus"
+#define DBUS_DAEMON_INTERFACE   "org.freedesktop.DBus"
+#define DBUS_SD_OWNER_MATCH "type='signal'," \
+                      "sender='" DBUS_DAEMON_NAME "'," \
+                      "path='" DBUS_DAEMON_OBJECT_PATH "'," \
+                      "interface='" DBUS_DAEMON_INTERFACE "'," \
+                      "member='NameOwnerChanged'," \
+                      "arg0='" DBUS_SD_SERVICE_NAME "'"
+
+/* With -standby: the bus giving us our name, on the user bus. */
+#define DBUS_STANDBY_MATCH "type='signal'," \
+                      "sender='" DBUS_DAEMON_NAME "'," \
+                      "path='" DBUS_DAEMON_OBJECT_PATH "'," \
+                      "interface='" DBUS_DAEMON_INTERFACE "'," \
+                      "member='NameAcquired'," \
+                      "arg0='" DBUS_FDO_NAME "'"
+
+#define DBUS_PROPERTIES_INTERFACE "org.freedesktop.DBus.Properties"
+
+/* logind documents LidClosed and Docked, but does not announce changes to
+   them; UPower's LidIsClosed does.  We listen to both. */
+#define DBUS_SD_PROPERTIES_MATCH "type='signal'," \
+                      "path='" DBUS_SD_OBJECT_PATH "'," \
+                      "interface='" DBUS_PROPERTIES_INTERFACE "'," \
+                      "member='PropertiesChanged'," \
+                      "arg0='" DBUS_SD_INTERFACE "'"
+
+#define DBUS_UPOWER_NAME        "org.freedesktop.UPower"
+#define DBUS_UPOWER_OBJECT_PATH "/org/freedesktop/UPower"
+#define DBUS_UPOWER_INTERFACE   "org.freedesktop.UPower"
+#define DBUS_UPOWER_PROPERTIES_MATCH "type='signal'," \
+                      "path='" DBUS_UPOWER_OBJECT_PATH "'," \
+                      "interface='" DBUS_PROPERTIES_INTERFACE "'," \
+                      "member='PropertiesChanged'," \
+                      "arg0='" DBUS_UPOWER_INTERFACE "'"
+
+#define DBUS_GSM_NAME          "org.gnome.SessionManager"
+#define DBUS_GSM_OBJECT_PATH   "/org/gnome/SessionManager"
+#define DBUS_GSM_INTERFACE     "org.gnome.SessionManager"
+#define DBUS_MSM_NAME          "org.mate.SessionManager"
+#define DBUS_MSM_OBJECT_PATH   "/org/mate/SessionManager"
+#define DBUS_MSM_INTERFACE     "org.mate.SessionManager"
+
+#define DBUS_SD_BLOCK_WHY      "an application asked for suspend to wait"
+#define DBUS_SD_BLOCK_MODE     "block"
+
+#define DBUS_FDO_NAME          "org.freedesktop.ScreenSaver"
+#define DBUS_FDO_OBJECT_PATH   "/ScreenSaver"
+#define DBUS_FDO_OBJECT_PATH_2 "/org/freedesktop/ScreenSaver"
+#define DBUS_FDO_INTERFACE     "org.freedesktop.ScreenSaver"
+
+/* Logging.
+
+   Once the event loop is running, nothing writes to stderr directly: that
+   is often a pipe to the journal, and if it backs up we would stall with
+   the sleep delay lock held.  Instead, xlog() formats into a preallocated
+   ring of fixed-size records, and xlog_flush() pushes them out with
+   non-blocking writes from the bottom of the event loop, after all
+   dispatching is done.  If the sink would block, records stay queued and
+   the loop polls the sink for writability.  If the ring fills, new
+   records are dropped and counted.
+
+   When our stderr is connected to the journal ($JOURNAL_STREAM), we talk
+   the native journal protocol instead, so that the structured fields
+   (COOKIE=, APP=, PHASE=, LATENCY_USEC=) can be queried with journalctl.
+ */
+
+#define XLOG_RING_SIZE 64
+#define XLOG_JOURNAL_SOCKET "/run/systemd/journal/socket"
+
+#define XLOG_COOKIE  (1<<0)
+#define XLOG_APP     (1<<1)
+#define XLOG_PHASE   (1<<2)
+#define XLOG_LATENCY (1<<3)
+
+/* Optional structured fields attached to a log record. */
+struct xlog_fields {
+  unsigned int mask;            /* Which of these are set: XLOG_* */
+  uint32_t cookie;
+  const char *app;              /* Copied into the record */
+  const char *phase;            /* Must be a string constant */
+  uint64_t latency_usec;
+};
+
+struct xlog_record {
+  int priority;
+  unsigned int mask;
+  uint32_t cookie;
+  const char *phase;
+  uint64_t latency_usec;
+  char app[64];
+  char message[256];
+};
+
+static struct {
+  struct xlog_record ring[XLOG_RING_SIZE];
+  unsigned int head, tail;      /* head == tail means empty */
+  unsigned long dropped;
+  int fd;                       /* Journal socket, or 2 for stderr */
+  int journal_p;
+} xlog_state = { { { 0 } }, 0, 0, 0, 2, 0 };
+
+/* One line per record, for both sinks.  This goes for anything that
+   came from a client too: a newline in it would start a journal field
+   of their choosing. */
+static void
+xlog_one_line (char *s)
+{
+  for (; *s; s++)
+    if (*s == '\n') *s = ' ';
+}
+
+static void
+xlog_v (int priority, const struct xlog_fields *f,
+        const char *fmt, va_list args)
+{
+  struct xlog_record *r;
+
+  if (priority > log_level)
+    return;
+
+  if (xlog_state.head - xlog_state.tail >= XLOG_RING_SIZE)
+    {
+      xlog_state.dropped++;
+      return;
+    }
+
+  r = &xlog_state.ring[xlog_state.head % XLOG_RING_SIZE];
+  r->priority = priority;
+  r->mask = f ? f->mask : 0;
+  if (f)
+    {
+      r->cookie = f->cookie;
+      r->phase = f->phase;
+      r->latency_usec = f->latency_usec;
+      if (f->mask & XLOG_APP)
+        {
+          strncpy (r->app, f->app ? f->app : "", sizeof(r->app) - 1);
+          r->app[sizeof(r->app) - 1] = 0;
+          xlog_one_line (r->app);
+        }
+    }
+  vsnprintf (r->message, sizeof(r->message), fmt, args);
+  xlog_one_line (r->message);
+
+  xlog_state.head++;
+}
+
+static void
+xlog (int priority, const char *fmt, ...)
+{
+  va_list args;
+  va_start (args, fmt);
+  xlog_v (priority, NULL, fmt, args);
+  va_end (args);
+}
+
+static void
+xlog_event (int priority, const struct xlog_fields *f, const char *fmt, ...)
+{
+  va_list args;
+  va_start (args, fmt);
+  xlog_v (priority, f, fmt, args);
+  va_end (args);
+}
+
+/* Render a record for the current sink.  Returns the length. */
+static int
+xlog_format (const struct xlog_record *r, char *buf, int size)
+{
+  int n;
+
+  if (!xlog_state.journal_p)
+    return snprintf (buf, size, "%s: %s\n", progname, r->message);
+
+  n = snprintf (buf, size,
+                "PRIORITY=%d\nSYSLOG_IDENTIFIER=%s\nMESSAGE=%s\n",
+                r->priority, progname, r->message);
+  if (n < size && (r->mask & XLOG_COOKIE))
+    n += snprintf (buf + n, size - n, "COOKIE=%u\n", r->cookie);
+  if (n < size && (r->mask & XLOG_APP))
+    n += snprintf (buf + n, size - n, "APP=%s\n", r->app);
+  if (n < size && (r->mask & XLOG_PHASE))
+    n += snprintf (buf + n, size - n, "PHASE=%s\n", r->phase);
+  if (n < size && (r->mask & XLOG_LATENCY))
+    n += snprintf (buf + n, size - n, "LATENCY_USEC=%lu\n",
+                   (unsigned long) r->latency_usec);
+  return n;
+}
+
+/* Write one rendered record without ever blocking.
+   Returns 1 if it went out, 0 if the sink is full.
+ */
+static int
+xlog_write (const char *buf, int len)
+{
+  ssize_t rc;
+
+  if (xlog_state.journal_p)
+    rc = send (xlog_state.fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+  else
+    {
+      /* stderr may be a blocking pipe that we don't own, so we can't make
+         it non-blocking.  Ask first: a pipe that polls writable has room
+         for at least a page, which is more than one record.
+       */
+      struct pollfd pfd;
+      pfd.fd = xlog_state.fd;
+      pfd.events = POLLOUT;
+      pfd.revents = 0;
+      if (poll (&pfd, 1, 0) <= 0 || !(pfd.revents & POLLOUT))
+        return 0;
+      rc = write (xlog_state.fd, buf, len);
+    }
+
+  if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return 0;
+  return 1;  /* Written, or failed for good: either way, move on. */
+}
+
+/* Push out as much of the ring as the sink will take right now.
+   Returns nonzero if records are still pending.
+ */
+static int
+xlog_flush (void)
+{
+  char buf[1024];
+  int len;
+
+  if (xlog_state.dropped)
+    {
+      struct xlog_record r;
+      r.priority = LOG_WARNING;
+      r.mask = 0;
+      sprintf (r.message, "%lu log messages dropped", xlog_state.dropped);
+      len = xlog_format (&r, buf, sizeof(buf));
+      if (!xlog_write (buf, len))
+        return 1;
+      xlog_state.dropped = 0;
+    }
+
+  while (xlog_state.tail != xlog_state.head)
+    {
+      struct xlog_record *r =
+        &xlog_state.ring[xlog_state.tail % XLOG_RING_SIZE];
+      len = xlog_format (r, buf, sizeof(buf));
+      if (len >= (int) sizeof(buf))
+        len = sizeof(buf) - 1;
+      if (!xlog_write (buf, len))
+        return 1;
+      xlog_state.tail++;
+    }
+  return 0;
+}
+
+/* On the way out, blocking is fine: give the sink a moment to drain. */
+static void
+xlog_drain (void)
+{
+  int tries;
+  for (tries = 0; tries < 100 && xlog_flush(); tries++)
+    {
+      struct pollfd pfd;
+      pfd.fd = xlog_state.fd;
+      pfd.events = POLLOUT;
+      pfd.revents = 0;
+      poll (&pfd, 1, 10);
+    }
+}
+
+/* Use the native journal protocol if our stderr is going to the journal
+   anyway; otherwise keep writing to stderr.
+ */
+static void
+xlog_init (void)
+{
+  struct sockaddr_un sa;
+  int fd;
+
+  if (!getenv ("JOURNAL_STREAM"))
+    return;
+
+  fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+    return;
+
+  memset (&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy (sa.sun_path, XLOG_JOURNAL_SOCKET);
+  if (connect (fd, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+    {
+      close (fd);
+      return;
+    }
+
+  xlog_state.fd = fd;
+  xlog_state.journal_p = 1;
+}
+
+
+/* The verbs we pass to xscreensaver-command.  Indexes into the per-verb
+   counters in struct xscreensaver_stats.
+ */
+enum xscreensaver_verb {
+  XSS_SUSPEND,
+  XSS_DEACTIVATE,
+  XSS_LOCK,
+  XSS_VERSION,                  /* Harmless: for timing the backends */
+  XSS_NVERBS
+};
+
+static const char * const xscreensaver_verbs[XSS_NVERBS] = {
+  "suspend",
+  "deactivate",
+  "lock",
+  "version"
+};
+
+/* The ways we have of getting a command to xscreensaver, fastest first
+   until xscreensaver_calibrate() has measured them.
+ */
+enum command_backend {
+  BACKEND_X,                    /* ClientMessage on our own connection */
+  BACKEND_HELPER,               /* The -spawn-helper process */
+  BACKEND_SPAWN,                /* fork and exec it ourselves */
+  BACKEND_NBACKENDS
+};
+
+static const char * const backend_names[BACKEND_NBACKENDS] = {
+  "x", "helper", "spawn"
+};
+
+/* The logind events that make us run a command, for latency accounting. */
+enum lock_trigger {
+  TRIGGER_SLEEP,
+  TRIGGER_RESUME,
+  TRIGGER_LOCK,
+  TRIGGER_UNLOCK,
+  TRIGGER_SHUTDOWN,
+  TRIGGER_NTRIGGERS
+};
+
+static const char * const trigger_names[TRIGGER_NTRIGGERS] = {
+  "sleep", "resume", "lock", "unlock", "shutdown"
+};
+
+/* Where we are with the logind "sleep" delay lock.  The normal cycle is
+   idle -> acquiring -> held -> locking -> released -> resuming ->
+   acquiring -> held ..., but signals can arrive in other orders: see
+   xscreensaver_systemd_handler().
+ */
+enum sleep_state {
+  SLEEP_IDLE,           /* No lock, and none asked for */
+  SLEEP_ACQUIRING,      /* Inhibit sent, waiting for the reply */
+  SLEEP_HELD,           /* Holding the lock, awake */
+  SLEEP_LOCKING,        /* PrepareForSleep(true): running -suspend */
+  SLEEP_RELEASED,       /* Lock let go, the system is going to sleep */
+  SLEEP_RESUMING,       /* PrepareForSleep(false): running -deactivate */
+  SLEEP_NSTATES
+};
+
+static const char * const sleep_state_names[SLEEP_NSTATES] = {
+  "idle", "acquiring", "held", "locking", "released", "resuming"
+};
+
+/* After a failed Inhibit, wait this long before asking again. */
+#define SLEEP_RETRY_USEC 10000000
+
+/* After a failed block lock, wait this long before asking again, twice
+   as long after each further failure, up to the cap. */
+#define BLOCK_RETRY_USEC     250000
+#define BLOCK_RETRY_MAX_USEC 30000000
+
+/* Why the event loop woke up from poll(). */
+enum wakeup_cause {
+  WAKE_SYSTEM_BUS,
+  WAKE_USER_BUS,
+  WAKE_TIMEOUT,
+  WAKE_NCAUSES
+};
+
+enum bus_id {
+  BUS_SYSTEM,
+  BUS_USER,
+  BUS_NBUSES
+};
+
+static const char * const bus_names[BUS_NBUSES] = { "system", "user" };
+
+/* What the event loop spends its time on, between one poll() and the
+   next.  Each is timed separately by the profiler. */
+enum loop_source {
+  SOURCE_SYSTEM_BUS,    /* Including the block lock */
+  SOURCE_USER_BUS,
+  SOURCE_X11,           /* Events and the idle hint, per session */
+  SOURCE_INHIBIT_FD,    /* Hangups */
+  SOURCE_CONFIG,
+  SOURCE_TIMERS,
+  SOURCE_LOG,           /* Writing it out, flushing -record, and the
+                           setting up for poll() around that */
+  SOURCE_NSOURCES
+};
+
+static const char * const source_names[SOURCE_NSOURCES] = {
+  "system_bus", "user_bus", "x11", "inhibit_fd", "config", "timers", "log"
+};
+
+/* A callback that took longer than config->slow_callback_ms. */
+struct slow_callback {
+  time_t when;                  /* Wall clock */
+  enum loop_source source;
+  char name[40];                /* Bus member or session, or "" */
+  uint64_t nsec;
+};
+
+#define SLOW_RING_SIZE 32
+
+/* Cumulative counters, reported by the Stats interface.  These are only
+   ever bumped with plain increments: no locks, no allocation.
+ */
+struct xscreensaver_stats {
+  uint64_t inhibit_calls;
+  uint64_t uninhibit_calls;
+  uint64_t uninhibit_unknown;
+  uint64_t fd_hangups;          /* InhibitFd clients that closed the pipe */
+  uint64_t lease_renewals;
+  uint64_t leases_expired;
+  uint64_t commands[XSS_NVERBS];
+  uint64_t commands_failed;
+  uint64_t heartbeats;
+  uint64_t heartbeats_skipped;  /* The user was active more recently */
+  uint64_t heartbeats_hidden;   /* Lid closed or display powered off */
+  uint64_t commands_skipped;    /* The screen was already locked */
+  uint64_t wakeups[WAKE_NCAUSES];
+  uint64_t bus_messages[BUS_NBUSES];
+  uint64_t bus_bytes[BUS_NBUSES];
+  uint64_t triggers[TRIGGER_NTRIGGERS];
+  uint64_t trigger_usec[TRIGGER_NTRIGGERS];      /* Total */
+  uint64_t trigger_usec_max[TRIGGER_NTRIGGERS];
+  uint64_t sleep_state_count[SLEEP_NSTATES];    /* Times entered */
+  uint64_t sleep_state_usec[SLEEP_NSTATES];     /* Time spent, total */
+  uint64_t sleep_acquire_failed;
+  uint64_t sleep_out_of_order;  /* Signals that did not fit the cycle */
+  uint64_t logind_restarts;     /* Times its unique name changed */
+  uint64_t idle_hints;          /* SetIdleHint calls */
+  uint64_t standby_takeovers;   /* Names handed to us from another copy */
+  uint64_t resume_ready;        /* Sessions that got -deactivate in time */
+  uint64_t resume_ready_usec;   /* Total, from PrepareForSleep(false) */
+  uint64_t resume_ready_usec_max;
+  uint64_t resume_retries;
+  uint64_t resume_gave_up;      /* Sent -deactivate blind at the end */
+  uint64_t inhibits_limited;    /* Refused by inhibit_rate */
+  uint64_t inhibits_ignored;    /* Matched an ignore rule */
+  uint64_t config_loads;
+  uint64_t config_errors;
+  uint64_t backend_usec[BACKEND_NBACKENDS];     /* Probe, 0 if unusable */
+  uint64_t backend_commands[BACKEND_NBACKENDS];
+  uint64_t backend_fallbacks[BACKEND_NBACKENDS]; /* Passed on to the next */
+  uint64_t source_nsec[SOURCE_NSOURCES];        /* Busy time, total */
+  uint64_t source_nsec_max[SOURCE_NSOURCES];    /* Longest callback */
+  uint64_t source_callbacks[SOURCE_NSOURCES];
+  uint64_t poll_nsec;           /* Asleep in poll() */
+  uint64_t loop_wakeups;
+  uint64_t loop_callbacks_max;  /* In any one wakeup */
+  uint64_t slow_callbacks;
+};
+
+/* What an inhibitor is inhibiting: the flags of GNOME's and MATE's
+   SessionManager.Inhibit.  org.freedesktop.ScreenSaver ones are "idle".
+ */
+enum inhibit_flag {
+  INHIBIT_LOGOUT      = 1,
+  INHIBIT_SWITCH_USER = 2,
+  INHIBIT_SUSPEND     = 4,
+  INHIBIT_IDLE        = 8
+};
+
+#define INHIBIT_NFLAGS 4
+#define INHIBIT_SUSPEND_BIT 2   /* Index into per-flag counters */
+static const char * const inhibit_flag_names[INHIBIT_NFLAGS] = {
+  "logout", "switch_user", "suspend", "idle"
+};
+
+struct inhibit_entry {
+  uint32_t cookie;
+  uint32_t flags;       /* enum inhibit_flag */
+  char *application;
+  char *reason;
+  char *owner;          /* Unique bus name of the caller */
+  time_t since;
+  struct session_ctx *session;
+  uint64_t lease_usec;  /* 0 if it lasts until UnInhibit */
+  uint64_t expires;     /* xscreensaver_usec() deadline, if leased */
+  int heap_index;       /* Position in handler_ctx.leases, or -1 */
+  int fd;               /* Our end of an InhibitFd pipe, or -1 */
+  LIST_ENTRY(inhibit_entry) entries;    /* In its session */
+  LIST_ENTRY(inhibit_entry) by_cookie;  /* In its hash bucket */
+  LIST_ENTRY(inhibit_entry) by_fd;      /* In handler_ctx.fd_inhibitors */
+};
+
+LIST_HEAD(inhibit_head, inhibit_entry);
+
+/* Cookies are random, so the low bits make a fine hash. */
+#define INHIBIT_HASH_SIZE 1024
+#define INHIBIT_HASH(cookie) ((cookie) & (INHIBIT_HASH_SIZE - 1))
+
+/* From -lease: applications matching 'pattern' get a lease of 'usec'. */
+struct lease_rule {
+  const char *pattern;
+  uint64_t usec;
+};
+
+#define MAX_LEASE_RULES 32
+static struct lease_rule lease_rules[MAX_LEASE_RULES];
+static int nlease_rules = 0;
+
+/* Tuning that can change while we run.
+
+   Read from $XDG_CONFIG_HOME/xscreensaver-systemd.conf at startup and
+   again whenever inotify says that file changed.  If that directory does
+   not exist yet, its parent is watched until it does; if the parent is
+   missing too, the file is only read at startup.  The new file is parsed
+   off to the side, from the bottom of the event loop rather than inside
+   any handler, into a fresh struct config.  Only if all of it parses is
+   'config' pointed at the new one, in one store, and the old one freed.
+   Nothing in here refers to inhibitors, so the live ones are untouched.
+   Lines are "key = value", and '#' starts a comment:
+
+     heartbeat = 50           Seconds between "-deactivate"s while inhibited
+     heartbeat_hidden = hold  Or "run": whether to hold them back while
+                              nobody can see the screen
+     inhibit_rate = 0         Inhibit calls allowed per second, from all
+                              clients together; 0 for no limit
+     inhibit_burst = 50       How many of those may come at once
+     suspend_deadline = 0     Milliseconds to wait for "-suspend" before
+                              letting the system sleep anyway; 0 to wait
+     log_level = notice       debug, info, notice, warning or err.
+                              -verbose overrides it.
+     slow_callback = 50       Log any event loop callback that takes more
+                              milliseconds than this; 0 to never log
+     lease = PATTERN=SECONDS  As -lease.  Those given with -lease win.
+     ignore = APP [REASON]    Answer Inhibit from applications matching
+                              the APP pattern (and REASON, if given), but
+                              do not let them keep the screen from blanking
+ */
+
+#define CONFIG_FILE "xscreensaver-systemd.conf"
+#define MAX_IGNORE_RULES 32
+
+struct ignore_rule {
+  const char *application;      /* fnmatch() patterns */
+  const char *reason;           /* NULL for any */
+};
+
+struct config {
+  int heartbeat_secs;
+  int hold_hidden_p;
+  int inhibit_rate;             /* Per second, or 0 */
+  int inhibit_burst;
+  int suspend_deadline_ms;      /* 0 to wait as long as it takes */
+  int log_level;
+  int slow_callback_ms;         /* 0 to never say */
+  struct lease_rule leases[MAX_LEASE_RULES];
+  int nleases;
+  struct ignore_rule ignores[MAX_IGNORE_RULES];
+  int nignores;
+  char *text;                   /* The file: the patterns point into it */
+};
+
+static const struct config default_config = {
+  50, 1, 0, 50, 0, LOG_NOTICE, 50
+};
+static const struct config *config = &default_config;
+
+/* One per logind session whose xscreensaver we talk to.  Everything that
+   is shared between sessions (bus connections, the sleep lock, counters)
+   lives in struct handler_ctx instead, so this stays small.
+ */
+struct session_ctx {
+  char *id;                     /* logind session ID, or "" */
+  char *path;                   /* logind object path, or NULL */
+  char *display;                /* $DISPLAY for xscreensaver-command */
+  struct inhibit_head inhibitors;
+  int is_inhibited;
+  time_t last_deactivate_time;
+  pid_t pid;                    /* xscreensaver-command we are waiting for */
+  uint32_t helper_id;           /* Our request to the spawn helper, or 0 */
+  int run_p;                    /* Selected for the next command batch */
+  int status;                   /* Of the last command: exit code, or -1 */
+  uint64_t usec;                /* How long the last command took */
+  uint64_t resume_start;        /* PrepareForSleep(false), until we have
+                                   got -deactivate through, or 0 */
+  uint64_t resume_retry_at;     /* Next step of resume_retry_ms[] */
+  int resume_tries;
+  int resume_ready_p;           /* As of the last try */
+  int resume_poked_p;           /* Something changed: try again now */
+#ifdef HAVE_X11
+  Display *dpy;                 /* Our own connection to 'display' */
+  Window root;
+  Window xss_window;            /* Where xscreensaver takes commands, or 0 */
+  Atom status_atom, blank_atom, lock_atom;
+  Atom version_atom, response_atom, command_atom;
+  Atom verb_atoms[XSS_NVERBS];
+  Atom saver_state;             /* 0, blank_atom or lock_atom */
+  time_t saver_since;           /* When saver_state last changed */
+  int xss_p;                    /* MIT-SCREEN-SAVER, for the idle time */
+  int x_dead_p;                 /* The connection has been lost */
+  int idle_hint;                /* Last told to logind: 0, 1, or -1 */
+#endif
+  LIST_ENTRY(session_ctx) entries;
+};
+
+LIST_HEAD(session_head, session_ctx);
+
+/* A signal that we take only from logind.  The match is on logind's
+   unique name, so it is made again whenever that changes. */
+struct logind_match {
+  const char *match;            /* Without the sender */
+  sd_bus_message_handler_t handler;
+  sd_bus_slot *slot;            /* NULL while logind is not running */
+};
+
+#define LOGIND_MAX_MATCHES 8
+
+/* A logind delay lock: held until we close 'fd'. */
+struct logind_lock {
+  const char *what;
+  const char *why;
+  const char *mode;
+  sd_bus_message *message;
+  int fd;
+};
+
+/* Commands run past their deadline that we remember to reap later. */
+#define MAX_ABANDONED 16
+
+struct handler_ctx {
+  sd_bus *system_bus;
+  int helper_fd;                /* Socket to the spawn helper, or -1 */
+  struct logind_lock sleep_lock;
+  struct logind_lock shutdown_lock;
+  struct logind_lock block_lock;        /* For INHIBIT_SUSPEND */
+  int is_inhibited;             /* Idle inhibitors, over all sessions */
+  int inhibit_flags[INHIBIT_NFLAGS];    /* Inhibitors with each flag */
+  int ninhibitors;              /* Of any kind */
+  time_t last_active;           /* For -inhibit-only: last call or inhibitor,
+                                   in xscreensaver_secs() */
+  int all_sessions_p;
+  struct session_head sessions;
+  struct session_ctx *default_session;
+  int nsessions;
+  struct xscreensaver_stats stats;
+  struct inhibit_head by_cookie[INHIBIT_HASH_SIZE];
+  struct inhibit_entry **leases;        /* Min-heap on 'expires' */
+  int nleases, leases_size;
+  struct inhibit_head fd_inhibitors;    /* Those from InhibitFd */
+  int nfd_inhibitors;
+  int lid_closed;
+  int docked;                   /* As of when the lid last closed */
+  int lid_watched_p;            /* We will be told when the lid opens */
+  enum sleep_state sleep_state;
+  uint64_t sleep_state_since;
+  int sleep_acquire_pending;    /* An Inhibit call is outstanding */
+  uint64_t sleep_acquire_start;
+  uint64_t sleep_retry_at;      /* When to try again from idle, or 0 */
+  uint64_t block_retry_at;      /* When to ask for block_lock again, or 0 */
+  uint64_t block_retry_usec;    /* How long we waited last time */
+  enum command_backend backends[BACKEND_NBACKENDS];  /* In order of cost */
+  int nbackends;                /* 0 until calibrated */
+  uint64_t command_deadline;    /* For the batch being run, or 0 */
+  pid_t abandoned[MAX_ABANDONED];       /* Commands we stopped waiting for */
+  int nabandoned;
+  uint64_t inhibit_tokens;      /* For inhibit_rate, in millionths */
+  uint64_t inhibit_tokens_at;
+  char *logind_owner;           /* Its unique name, or NULL */
+  struct logind_match logind_matches[LOGIND_MAX_MATCHES];
+  int nlogind_matches;
+  int standby_waiting_p;        /* -standby: another copy has our names */
+  char dispatch_name[40];       /* Member of the message being dispatched */
+  uint64_t wakeup_callbacks;    /* So far in this pass of the loop */
+  struct slow_callback slow_ring[SLOW_RING_SIZE];
+  unsigned long nslow;          /* Ever recorded; the next slot, mod size */
+};
+
+static struct handler_ctx global_ctx = {
+  NULL,
+  -1,
+  { DBUS_SD_METHOD_WHAT, DBUS_SD_METHOD_WHY, DBUS_SD_METHOD_MODE, NULL, -1 },
+  { DBUS_SD_SHUTDOWN_WHAT, DBUS_SD_SHUTDOWN_WHY, DBUS_SD_METHOD_MODE,
+    NULL, -1 },
+  { DBUS_SD_METHOD_WHAT, DBUS_SD_BLOCK_WHY, DBUS_SD_BLOCK_MODE, NULL, -1 }
+};
+
+/* The clock.  Everything that reads the time, or waits for it, goes
+   through these.  Normally they ask the kernel; under -simulate, the
+   script moves a virtual clock instead, and nobody waits at all.
+ */
+static int virtual_clock_p = 0;
+static uint64_t virtual_usec;           /* Stands in for CLOCK_MONOTONIC */
+static uint64_t virtual_epoch;          /* virtual_usec when we started */
+static time_t virtual_wall_offset;      /* Wall clock minus monotonic */
+
+/* Monotonic microseconds, for measuring how long things take.
+ */
+static uint64_t
+xscreensaver_usec (void)
+{
+  struct timespec ts;
+  if (virtual_clock_p)
+    return virtual_usec;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Monotonic nanoseconds, for the event loop profiler.  Always the real
+   clock, even under -simulate: what it measures is our own time.
+ */
+static uint64_t
+xscreensaver_nsec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Monotonic seconds, for heartbeats and other timeouts, which should
+   not care when somebody sets the date.
+ */
+static time_t
+xscreensaver_secs (void)
+{
+  return xscreensaver_usec() / 1000000;
+}
+
+/* The wall clock, for times that people will read. */
+static time_t
+xscreensaver_time (void)
+{
+  if (virtual_clock_p)
+    return virtual_wall_offset + xscreensaver_secs();
+  return time (NULL);
+}
+
+/* Recording traces.
+
+   A trace is a struct record_header followed by records.  Each record is
+   a fixed struct record_entry, followed by 'len' bytes of NUL-terminated
+   strings (application and reason, for Inhibit).  Each run of the daemon
+   appends to the file, starting with a RECORD_START; times are
+   microseconds since then.  Records go through stdio's buffer and are
+   flushed from the bottom of the event loop along with the logs.
+ */
+
+#define RECORD_MAGIC   "XSSTRACE"
+#define RECORD_VERSION 1
+
+enum record_type {
+  RECORD_INHIBIT   = 'I',       /* cookie = what we returned, arg = flags */
+  RECORD_UNINHIBIT = 'U',       /* arg = found */
+  RECORD_RENEW     = 'R',       /* arg = found */
+  RECORD_HANGUP    = 'H',       /* An InhibitFd pipe was closed */
+  RECORD_SLEEP     = 'S',       /* arg = before_sleep */
+  RECORD_START     = 'T'        /* A new run: the clock and cookies restart */
+};
+
+struct record_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;          /* 0x01020304, written natively */
+};
+
+struct record_entry {
+  uint64_t usec;
+  uint32_t cookie;
+  uint16_t len;
+  uint8_t type;
+  uint8_t arg;
+};
+
+static FILE *record_file = NULL;
+static uint64_t record_start;
+
+static void
+xscreensaver_record (enum record_type type, int arg, uint32_t cookie,
+                     const char *app, const char *reason)
+{
+  struct record_entry e;
+  size_t alen = 0, rlen = 0;
+
+  if (!record_file)
+    return;
+  if (app && reason)
+    {
+      alen = strlen (app) + 1;
+      rlen = strlen (reason) + 1;
+      if (alen + rlen > 0xFFFF)
+        {
+          /* Too long to keep, but still an Inhibit to play back. */
+          app = reason = "";
+          alen = rlen = 1;
+        }
+    }
+  e.usec = xscreensaver_usec() - record_start;
+  e.cookie = cookie;
+  e.len = alen + rlen;
+  e.type = type;
+  e.arg = arg;
+  fwrite (&e, sizeof(e), 1, record_file);
+  if (app && reason)
+    {
+      fwrite (app, alen, 1, record_file);
+      fwrite (reason, rlen, 1, record_file);
+    }
+}
+
+static int
+xscreensaver_record_open (const char *file)
+{
+  struct record_header h, want;
+  size_t n;
+
+  memset (&want, 0, sizeof(want));
+  memcpy (want.magic, RECORD_MAGIC, sizeof(want.magic));
+  want.version = RECORD_VERSION;
+  want.byte_order = 0x01020304;
+
+  record_file = fopen (file, "a+b");
+  if (!record_file)
+    {
+      warn ("%s", file);
+      return -1;
+    }
+
+  /* Only add to a trace that we could play back as one. */
+  rewind (record_file);
+  n = fread (&h, sizeof(h), 1, record_file);
+  if (n != 1 && (ferror (record_file) || ftell (record_file) != 0))
+    goto FAIL;
+  if (n == 1 && memcmp (&h, &want, sizeof(h)))
+    goto FAIL;
+
+  /* Going from reading to writing takes a seek in between. */
+  fseek (record_file, 0, SEEK_END);
+  if (n != 1)
+    fwrite (&want, sizeof(want), 1, record_file);
+
+  record_start = xscreensaver_usec();
+  xscreensaver_record (RECORD_START, 0, 0, NULL, NULL);
+  return 0;
+
+ FAIL:
+  warnx ("%s: not a trace from this machine and version", file);
+  fclose (record_file);
+  record_file = NULL;
+  return -1;
+}
+
+
+static void
+xscreensaver_command_argv (enum xscreensaver_verb verb, char *arg, char **av)
+{
+  sprintf (arg, "-%s", xscreensaver_verbs[verb]);
+  av[0] = "xscreensaver-command";
+  av[1] = verbose_p ? "-verbose" : "-quiet";
+  av[2] = arg;
+  av[3] = NULL;
+}
+
+/* Account for one finished xscreensaver-command.  'status' is its exit
+   code, or -1 if it could not be run or did not exit normally.
+ */
+static void
+xscreensaver_command_done (struct handler_ctx *ctx, struct session_ctx *s,
+                           enum xscreensaver_verb verb, int status,
+                           uint64_t usec)
+{
+  struct xlog_fields f;
+  const char *dpy = s->display ? s->display : "$DISPLAY";
+
+  s->status = status;
+  s->usec = usec;
+  f.mask = XLOG_PHASE | XLOG_LATENCY;
+  f.phase = xscreensaver_verbs[verb];
+  f.latency_usec = usec;
+  TRACE3 (command_exit, xscreensaver_verbs[verb], status, usec);
+  if (status != 0)
+    {
+      ctx->stats.commands_failed++;
+      xlog_event (LOG_WARNING, &f,
+                  "exec: \"xscreensaver-command -%s\" on %s "
+                  "exited with status %d",
+                  xscreensaver_verbs[verb], dpy, status);
+    }
+  else
+    xlog_event (LOG_DEBUG, &f,
+                "exec: \"xscreensaver-command -%s\" on %s took %lu usec",
+                xscreensaver_verbs[verb], dpy, (unsigned long) usec);
+}
+
+
+/* The spawn helper.
+
+   Requests and replies are fixed-size datagrams on a SOCK_SEQPACKET
+   socketpair.  The helper runs requests as soon as they arrive, so that a
+   batch for several sessions runs in parallel, and answers each one when
+   its child exits.
+ */
+
+#define HELPER_MAX_CHILDREN 64
+#define HELPER_STACK_PREFAULT (64 * 1024)
+
+struct helper_request {
+  uint32_t id;
+  uint8_t verb;                 /* enum xscreensaver_verb */
+  uint8_t verbose;
+  char display[64];             /* "" means leave $DISPLAY alone */
+};
+
+struct helper_reply {
+  uint32_t id;
+  int32_t status;               /* Exit code, or -1 */
+  uint64_t fork_usec;           /* How long fork() took */
+  uint64_t run_usec;            /* From request to exit */
+};
+
+/* Touch a good chunk of stack now, so that the pages are there (and get
+   locked) before we need them.
+ */
+static void
+xscreensaver_prefault_stack (void)
+{
+  volatile char stack[HELPER_STACK_PREFAULT];
+  size_t i;
+  for (i = 0; i < sizeof(stack); i += 4096)
+    stack[i] = 0;
+}
+
+static void
+xscreensaver_helper_main (int sock)
+{
+  struct {
+    pid_t pid;
+    struct helper_reply reply;
+    uint64_t start;
+  } kids[HELPER_MAX_CHILDREN];
+  int nkids = 0;
+  sigset_t mask, omask;
+  struct pollfd fds[2];
+  int i;
+
+  prctl (PR_SET_PDEATHSIG, SIGTERM);
+  xscreensaver_prefault_stack ();
+  mlockall (MCL_CURRENT | MCL_FUTURE);  /* Best effort */
+
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGCHLD);
+  sigprocmask (SIG_BLOCK, &mask, &omask);
+  fds[0].fd = sock;
+  fds[0].events = POLLIN;
+  fds[1].fd = signalfd (-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+  fds[1].events = POLLIN;
+
+  while (1)
+    {
+      if (poll (fds, 2, -1) < 0)
+        {
+          if (errno == EINTR) continue;
+          _exit (1);
+        }
+
+      if (fds[0].revents)
+        {
+          struct helper_request req;
+          struct helper_reply rep;
+          char arg[32];
+          char *av[4];
+          uint64_t start = xscreensaver_usec();
+          pid_t pid;
+
+          ssize_t n = recv (sock, &req, sizeof(req), 0);
+          if (n < 0 && errno == EINTR)
+            continue;
+          if (n != sizeof(req))
+            _exit (0);  /* The daemon went away */
+
+          memset (&rep, 0, sizeof(rep));
+          rep.id = req.id;
+          rep.status = -1;
+          if (req.verb >= XSS_NVERBS || nkids >= HELPER_MAX_CHILDREN)
+            {
+              send (sock, &rep, sizeof(rep), MSG_NOSIGNAL);
+              continue;
+            }
+
+          verbose_p = req.verbose;
+          xscreensaver_command_argv (req.verb, arg, av);
+          req.display[sizeof(req.display) - 1] = 0;
+
+          pid = fork ();
+          if (pid == 0)
+            {
+              sigprocmask (SIG_SETMASK, &omask, NULL);
+              if (*req.display)
+                setenv ("DISPLAY", req.display, 1);
+              execvp (av[0], av);
+              _exit (127);
+            }
+          rep.fork_usec = xscreensaver_usec() - start;
+          if (pid < 0)
+            {
+              send (sock, &rep, sizeof(rep), MSG_NOSIGNAL);
+              continue;
+            }
+          kids[nkids].pid = pid;
+          kids[nkids].reply = rep;
+          kids[nkids].start = start;
+          nkids++;
+        }
+
+      if (fds[1].revents)
+        {
+          struct signalfd_siginfo si;
+          pid_t pid;
+          int status;
+
+          while (read (fds[1].fd, &si, sizeof(si)) == sizeof(si))
+            ;
+          while ((pid = waitpid (-1, &status, WNOHANG)) > 0)
+            for (i = 0; i < nkids; i++)
+              if (kids[i].pid == pid)
+                {
+                  struct helper_reply *rep = &kids[i].reply;
+                  rep->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+                  rep->run_usec = xscreensaver_usec() - kids[i].start;
+                  send (sock, rep, sizeof(*rep), MSG_NOSIGNAL);
+                  kids[i] = kids[--nkids];
+                  break;
+                }
+        }
+    }
+}
+
+/* Fork the helper.  This should happen before we open any connections or
+   allocate much, so that the helper is small and holds nothing of ours.
+ */
+static void
+xscreensaver_helper_start (struct handler_ctx *ctx)
+{
+  int sv[2];
+  pid_t pid;
+
+  if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+    {
+      warn ("spawn helper: socketpair");
+      return;
+    }
+
+  pid = fork ();
+  if (pid < 0)
+    {
+      warn ("spawn helper: fork");
+      close (sv[0]);
+      close (sv[1]);
+      return;
+    }
+  if (pid == 0)
+    {
+      close (sv[0]);
+      xscreensaver_helper_main (sv[1]);
+      _exit (0);
+    }
+
+  close (sv[1]);
+  ctx->helper_fd = sv[0];
+  xlog (LOG_INFO, "spawn helper: pid %ld", (long) pid);
+}
+
+static void
+xscreensaver_helper_lost (struct handler_ctx *ctx, const char *why)
+{
+  xlog (LOG_ERR, "spawn helper: %s, forking directly from now on", why);
+  close (ctx->helper_fd);
+  ctx->helper_fd = -1;
+}
+
+/* Hand every selected session's command to the helper, and wait for the
+   answers.  Sessions that got one have run_p cleared; if the helper dies
+   part way through, the rest are left for the caller to run directly.
+ */
+static void
+xscreensaver_command_helper (struct handler_ctx *ctx,
+                             enum xscreensaver_verb verb)
+{
+  struct session_ctx *s;
+  struct helper_request req;
+  struct helper_reply rep;
+  static uint32_t id = 0;       /* Late answers must not match new asks */
+  uint64_t start = xscreensaver_usec();
+  int pending = 0;
+
+  memset (&req, 0, sizeof(req));
+  req.verb = verb;
+  req.verbose = verbose_p;
+
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    {
+      s->helper_id = 0;
+      if (!s->run_p)
+        continue;
+      if (s->display && strlen (s->display) >= sizeof(req.display))
+        {
+          /* Left for the next backend, which has no such limit. */
+          xlog (LOG_WARNING, "spawn helper: display %s is too long",
+                s->display);
+          continue;
+        }
+      s->helper_id = ++id;
+      req.id = id;
+      strcpy (req.display, s->display ? s->display : "");
+      ctx->stats.commands[verb]++;
+      xlog (LOG_DEBUG, "spawn helper: xscreensaver-command -%s "
+            "(session \"%s\", display %s)", xscreensaver_verbs[verb],
+            s->id, s->display ? s->display : "unset");
+      if (send (ctx->helper_fd, &req, sizeof(req), MSG_NOSIGNAL)
+          != sizeof(req))
+        {
+          ctx->stats.commands[verb]--;
+          s->helper_id = 0;
+          xscreensaver_helper_lost (ctx, strerror(errno));
+          break;
+        }
+      pending++;
+    }
+
+  while (pending > 0 && ctx->helper_fd >= 0)
+    {
+      ssize_t n;
+      if (ctx->command_deadline)
+        {
+          struct pollfd fd;
+          uint64_t now = xscreensaver_usec();
+          fd.fd = ctx->helper_fd;
+          fd.events = POLLIN;
+          if (now >= ctx->command_deadline ||
+              poll (&fd, 1, (ctx->command_deadline - now + 999) / 1000) == 0)
+            {
+              now = xscreensaver_usec();
+              xlog (LOG_WARNING, "spawn helper: -%s still running after "
+                    "%lu ms, not waiting for it", xscreensaver_verbs[verb],
+                    (unsigned long) ((now - start) / 1000));
+              LIST_FOREACH (s, &ctx->sessions, entries)
+                if (s->run_p && s->helper_id)
+                  {
+                    s->run_p = 0;
+                    xscreensaver_command_done (ctx, s, verb, -1,
+                                               now - start);
+                  }
+              break;
+            }
+        }
+      n = recv (ctx->helper_fd, &rep, sizeof(rep), 0);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n != sizeof(rep))
+        {
+          xscreensaver_helper_lost (ctx, n == 0 ? "exited" : "bad reply");
+          break;
+        }
+      LIST_FOREACH (s, &ctx->sessions, entries)
+        if (s->run_p && s->helper_id && s->helper_id == rep.id)
+          {
+            s->run_p = 0;
+            s->helper_id = 0;
+            pending--;
+            xlog (LOG_DEBUG, "spawn helper: fork took %lu usec",
+                  (unsigned long) rep.fork_usec);
+            xscreensaver_command_done (ctx, s, verb, rep.status,
+                                       rep.run_usec);
+            break;
+          }
+    }
+
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    s->helper_id = 0;
+}
+
+/* Lock our own pages in, once everything we need on the suspend path has
+   been set up.  Best effort: RLIMIT_MEMLOCK may not allow it.
+ */
+static void
+xscreensaver_lock_memory (void)
+{
+  xscreensaver_prefault_stack ();
+  if (mlockall (MCL_CURRENT) < 0)
+    xlog (LOG_WARNING, "mlockall: %s", strerror(errno));
+}
+
+
+#ifdef HAVE_X11
+
+/* How long the X backend waits for xscreensaver to answer a command
+   before leaving it to the next backend.  It normally takes a few ms. */
+#define XSS_RESPONSE_USEC 2000000
+
+/* Following xscreensaver's state.
+
+   xscreensaver keeps the _SCREENSAVER_STATUS property on the root window
+   up to date: its first element is 0, BLANK or LOCK, and its second is
+   the time at which that last changed.  Each session has its own
+   connection to its display and asks for PropertyNotify on the root, so
+   we always have a current copy without having to run anything.
+
+   If the MIT-SCREEN-SAVER extension is there, we also use it to find out
+   how long the user has been idle.  (Only to read the idle time: see
+   xscreensaver.c for why it is no good for anything else.)
+ */
+
+static int
+xscreensaver_x_error (Display *dpy, XErrorEvent *e)
+{
+  xlog (LOG_DEBUG, "X error %d on request %d", e->error_code,
+        e->request_code);
+  return 0;
+}
+
+/* Called instead of exit() when a display goes away.  Xlib will not do
+   anything more on that connection, so we close it from the loop.
+ */
+static void
+xscreensaver_x_io_error (Display *dpy, void *closure)
+{
+  struct session_ctx *s = closure;
+  s->x_dead_p = 1;
+}
+
+static void
+xscreensaver_x_status (struct session_ctx *s)
+{
+  Atom type;
+  int format;
+  unsigned long nitems, after;
+  unsigned char *data = NULL;
+
+  s->saver_state = 0;
+  if (XGetWindowProperty (s->dpy, s->root, s->status_atom, 0, 3, False,
+                          XA_INTEGER, &type, &format, &nitems, &after,
+                          &data) == Success &&
+      type == XA_INTEGER && format == 32 && nitems >= 2)
+    {
+      long *status = (long *) data;
+      s->saver_state = status[0];
+      s->saver_since = status[1];
+    }
+  if (data)
+    XFree (data);
+}
+
+static const char *
+xscreensaver_x_state_name (struct session_ctx *s)
+{
+  return (s->saver_state == s->lock_atom ? "locked" :
+          s->saver_state == s->blank_atom ? "blanked" :
+          s->saver_state ? "unknown" : "active");
+}
+
+static void
+xscreensaver_x_open (struct session_ctx *s)
+{
+  int event_base, error_base;
+
+  s->dpy = XOpenDisplay (s->display);
+  if (!s->dpy)
+    {
+      xlog (LOG_WARNING, "session \"%s\": cannot open display %s",
+            s->id, s->display ? s->display : "$DISPLAY");
+      return;
+    }
+  s->x_dead_p = 0;
+  s->idle_hint = -1;
+  XSetErrorHandler (xscreensaver_x_error);
+  XSetIOErrorExitHandler (s->dpy, xscreensaver_x_io_error, s);
+  s->root = DefaultRootWindow (s->dpy);
+  s->status_atom = XInternAtom (s->dpy, "_SCREENSAVER_STATUS", False);
+  s->blank_atom  = XInternAtom (s->dpy, "BLANK", False);
+  s->lock_atom   = XInternAtom (s->dpy, "LOCK", False);
+  s->version_atom = XInternAtom (s->dpy, "_SCREENSAVER_VERSION", False);
+  s->response_atom = XInternAtom (s->dpy, "_SCREENSAVER_RESPONSE", False);
+  s->command_atom = XInternAtom (s->dpy, "SCREENSAVER", False);
+  s->verb_atoms[XSS_SUSPEND]    = XInternAtom (s->dpy, "SUSPEND", False);
+  s->verb_atoms[XSS_DEACTIVATE] = XInternAtom (s->dpy, "DEACTIVATE", False);
+  s->verb_atoms[XSS_LOCK]       = s->lock_atom;
+  /* Not a command xscreensaver knows, so all it does is answer with an
+     error: the same round trip as a real one, for timing. */
+  s->verb_atoms[XSS_VERSION]    = XInternAtom (s->dpy, "PING", False);
+  s->xss_p = XScreenSaverQueryExtension (s->dpy, &event_base, &error_base);
+  /* StructureNotify, for the ConfigureNotify that RandR sends when the
+     screen changes size: outputs coming back after a resume. */
+  XSelectInput (s->dpy, s->root, PropertyChangeMask | StructureNotifyMask);
+  xscreensaver_x_status (s);
+  xlog (LOG_DEBUG, "session \"%s\": xscreensaver is %s", s->id,
+        xscreensaver_x_state_name (s));
+}
+
+static void
+xscreensaver_x_close (struct session_ctx *s)
+{
+  if (s->dpy)
+    XCloseDisplay (s->dpy);
+  s->dpy = NULL;
+  s->saver_state = 0;
+  s->xss_window = 0;
+}
+
+/* Acts on one event from the display.  A _SCREENSAVER_RESPONSE that
+   nobody is waiting for any more ends up here, and is dropped. */
+static void
+xscreensaver_x_event (struct session_ctx *s, XEvent *event)
+{
+  if (event->type == PropertyNotify &&
+      event->xproperty.window == s->root &&
+      event->xproperty.atom == s->status_atom)
+    {
+      Atom old = s->saver_state;
+      xscreensaver_x_status (s);
+      if (s->saver_state != old)
+        {
+          xlog (LOG_DEBUG, "session \"%s\": xscreensaver is %s", s->id,
+                xscreensaver_x_state_name (s));
+          s->resume_poked_p = 1;
+        }
+    }
+  else if (event->type == ConfigureNotify &&
+           event->xconfigure.window == s->root)
+    {
+      xlog (LOG_DEBUG, "session \"%s\": screen is now %dx%d", s->id,
+            event->xconfigure.width, event->xconfigure.height);
+      s->resume_poked_p = 1;
+    }
+}
+
+/* Reads whatever the X server has sent us, without blocking.  Returns
+   how many events that was. */
+static int
+xscreensaver_x_process (struct session_ctx *s)
+{
+  int n = 0;
+  if (!s->dpy)
+    return 0;
+  while (!s->x_dead_p && XPending (s->dpy))
+    {
+      XEvent event;
+      XNextEvent (s->dpy, &event);
+      xscreensaver_x_event (s, &event);
+      n++;
+    }
+  if (s->x_dead_p)
+    {
+      xlog (LOG_WARNING, "session \"%s\": lost connection to display",
+            s->id);
+      xscreensaver_x_close (s);
+    }
+  return n;
+}
+
+static int
+xscreensaver_x_locked_p (struct session_ctx *s)
+{
+  xscreensaver_x_process (s);
+  return s->dpy && s->saver_state == s->lock_atom;
+}
+
+/* Seconds since the last keyboard or mouse activity, or -1. */
+static long
+xscreensaver_x_idle (struct session_ctx *s)
+{
+  XScreenSaverInfo info;
+  if (!s->dpy || !s->xss_p ||
+      !XScreenSaverQueryInfo (s->dpy, s->root, &info))
+    return -1;
+  return info.idle / 1000;
+}
+
+static int
+xscreensaver_x_window_p (struct session_ctx *s, Window w)
+{
+  Atom type = None;
+  int format;
+  unsigned long nitems, after;
+  unsigned char *data = NULL;
+  XGetWindowProperty (s->dpy, w, s->version_atom, 0, 1, False, XA_STRING,
+                      &type, &format, &nitems, &after, &data);
+  if (data)
+    XFree (data);
+  return type != None;
+}
+
+/* Finds the window that xscreensaver takes commands on, the same way
+   xscreensaver-command does: the top-level one with _SCREENSAVER_VERSION.
+   The answer is kept, and only looked for again once it stops being true.
+ */
+static Window
+xscreensaver_x_window (struct session_ctx *s)
+{
+  Window root, parent, *kids = NULL;
+  unsigned int nkids, i;
+
+  if (s->xss_window && xscreensaver_x_window_p (s, s->xss_window))
+    return s->xss_window;
+  s->xss_window = 0;
+  if (!XQueryTree (s->dpy, s->root, &root, &parent, &kids, &nkids))
+    return 0;
+  for (i = 0; i < nkids && !s->xss_window; i++)
+    if (xscreensaver_x_window_p (s, kids[i]))
+      s->xss_window = kids[i];
+  if (kids)
+    XFree (kids);
+  /* For _SCREENSAVER_RESPONSE.  Nobody else's selection is affected. */
+  if (s->xss_window)
+    XSelectInput (s->dpy, s->xss_window, PropertyChangeMask);
+  return s->xss_window;
+}
+
+/* Reads and deletes the answer that xscreensaver left on 'w': a string
+   that starts with '+' if the command worked and '-' if not.  Returns
+   0 or 1 for those, or -1 if it is not there after all.
+ */
+static int
+xscreensaver_x_read_response (struct session_ctx *s, Window w)
+{
+  Atom type;
+  int format;
+  unsigned long nitems, after;
+  unsigned char *data = NULL;
+  int status = -1;
+
+  if (XGetWindowProperty (s->dpy, w, s->response_atom, 0, 1024, True,
+                          XA_STRING, &type, &format, &nitems, &after,
+                          &data) == Success &&
+      type == XA_STRING && format == 8 && nitems > 0)
+    {
+      status = (*data == '+' ? 0 : 1);
+      xlog (LOG_DEBUG, "session \"%s\": xscreensaver says: %.*s", s->id,
+            (int) nitems, (char *) data);
+    }
+  if (data)
+    XFree (data);
+  return status;
+}
+
+/* Waits for xscreensaver to answer the command just sent to 'w', as
+   xscreensaver-command does: by setting _SCREENSAVER_RESPONSE on it.
+   Anything else that comes in meanwhile is handled as usual.  Returns
+   as for xscreensaver_x_read_response(), and -1 if there was no answer
+   by 'deadline'.
+ */
+static int
+xscreensaver_x_response (struct session_ctx *s, Window w, uint64_t deadline)
+{
+  while (!s->x_dead_p)
+    {
+      XEvent event;
+      if (!XPending (s->dpy))
+        {
+          struct pollfd fd;
+          uint64_t now = xscreensaver_usec();
+          if (now >= deadline)
+            break;
+          fd.fd = ConnectionNumber (s->dpy);
+          fd.events = POLLIN;
+          poll (&fd, 1, (deadline - now + 999) / 1000);
+          continue;
+        }
+      XNextEvent (s->dpy, &event);
+      if (event.type == PropertyNotify &&
+          event.xproperty.window == w &&
+          event.xproperty.atom == s->response_atom &&
+          event.xproperty.state == PropertyNewValue)
+        return xscreensaver_x_read_response (s, w);
+      xscreensaver_x_event (s, &event);
+    }
+  return -1;
+}
+
+/* Sends one command to xscreensaver as the ClientMessage that
+   xscreensaver-command would have sent, and waits until 'deadline' for
+   the answer.  Returns 0 if xscreensaver did it, 1 if it said no or is
+   not running, and -1 if the command may not have got there: the
+   display cannot be reached, or nothing came back.  XSS_VERSION only
+   asks for an answer, so any answer is 0.
+ */
+static int
+xscreensaver_x_send (struct session_ctx *s, enum xscreensaver_verb verb,
+                     uint64_t deadline)
+{
+  XEvent event;
+  Window w;
+  int status;
+
+  xscreensaver_x_process (s);
+  if (!s->dpy)
+    return -1;
+  w = xscreensaver_x_window (s);
+  if (!w)
+    return 1;
+
+  memset (&event, 0, sizeof(event));
+  event.xclient.type = ClientMessage;
+  event.xclient.display = s->dpy;
+  event.xclient.window = w;
+  event.xclient.message_type = s->command_atom;
+  event.xclient.format = 32;
+  event.xclient.data.l[0] = (long) s->verb_atoms[verb];
+  if (!XSendEvent (s->dpy, w, False, 0L, &event))
+    return -1;
+  XFlush (s->dpy);
+  status = xscreensaver_x_response (s, w, deadline);
+  if (status < 0)
+    xlog (LOG_WARNING, "session \"%s\": no answer from xscreensaver to %s",
+          s->id, xscreensaver_verbs[verb]);
+  if (s->x_dead_p)
+    return -1;
+  return (verb == XSS_VERSION && status > 0) ? 0 : status;
+}
+
+/* The X backend: every selected session whose display we have open gets
+   its command this way, and is done once xscreensaver has answered.
+   The rest, and any that got no answer, are left for the next backend.
+ */
+static void
+xscreensaver_command_x (struct handler_ctx *ctx,
+                        enum xscreensaver_verb verb)
+{
+  struct session_ctx *s;
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    {
+      uint64_t start = xscreensaver_usec();
+      uint64_t deadline = start + XSS_RESPONSE_USEC;
+      int status;
+      if (ctx->command_deadline && ctx->command_deadline < deadline)
+        deadline = ctx->command_deadline;
+      if (!s->run_p || (status = xscreensaver_x_send (s, verb, deadline)) < 0)
+        continue;
+      s->run_p = 0;
+      ctx->stats.commands[verb]++;
+      xscreensaver_command_done (ctx, s, verb, status,
+                                 xscreensaver_usec() - start);
+    }
+}
+
+/* Whether this display can show the unlock dialog yet: we can reach it,
+   xscreensaver is running there, and the monitor is on.  If DPMS has it
+   off, we turn it on, and say no for now; xscreensaver would otherwise
+   draw the dialog on a dark screen until the first keypress.
+ */
+static int
+xscreensaver_x_ready_p (struct session_ctx *s)
+{
+  CARD16 power;
+  BOOL enabled;
+
+  if (!s->dpy)
+    xscreensaver_x_open (s);
+  xscreensaver_x_process (s);
+  if (!s->dpy || !xscreensaver_x_window (s))
+    return 0;
+  if (DPMSCapable (s->dpy) && DPMSInfo (s->dpy, &power, &enabled) &&
+      enabled && power != DPMSModeOn)
+    {
+      xlog (LOG_DEBUG, "session \"%s\": monitor is off, turning it on",
+            s->id);
+      DPMSForceLevel (s->dpy, DPMSModeOn);
+      XFlush (s->dpy);
+      return 0;
+    }
+  return 1;
+}
+
+#else  /* !HAVE_X11 */
+# define xscreensaver_x_open(s)     do { } while (0)
+# define xscreensaver_x_close(s)    do { } while (0)
+# define xscreensaver_x_process(s)  do { } while (0)
+# define xscreensaver_x_locked_p(s) 0
+# define xscreensaver_x_idle(s)     (-1L)
+# define xscreensaver_x_ready_p(s)  1
+# define xscreensaver_command_x(ctx,verb) do { } while (0)
+#endif /* !HAVE_X11 */
+
+
+/* Reaps whichever of the commands that we stopped waiting for have
+   exited since.  Only those: the other children are waited for where
+   they were started.
+ */
+static void
+xscreensaver_reap_abandoned (struct handler_ctx *ctx)
+{
+  int i = 0;
+  while (i < ctx->nabandoned)
+    if (waitpid (ctx->abandoned[i], NULL, WNOHANG) != 0)
+      ctx->abandoned[i] = ctx->abandoned[--ctx->nabandoned];
+    else
+      i++;
+}
+
+/* waitpid(), but only until ctx->command_deadline if there is one.
+   Returns 0 if the child is still running by then.  SIGCHLD is blocked
+   in the daemon, so that it waits here for us to ask.
+ */
+static pid_t
+xscreensaver_waitpid (struct handler_ctx *ctx, pid_t pid, int *status)
+{
+  sigset_t chld;
+  pid_t rc;
+
+  if (!ctx->command_deadline)
+    {
+      do
+        rc = waitpid (pid, status, 0);
+      while (rc < 0 && errno == EINTR);
+      return rc;
+    }
+
+  sigemptyset (&chld);
+  sigaddset (&chld, SIGCHLD);
+  while ((rc = waitpid (pid, status, WNOHANG)) == 0)
+    {
+      uint64_t now = xscreensaver_usec();
+      struct timespec ts;
+      if (now >= ctx->command_deadline)
+        break;
+      ts.tv_sec = (ctx->command_deadline - now) / 1000000;
+      ts.tv_nsec = (ctx->command_deadline - now) % 1000000 * 1000;
+      sigtimedwait (&chld, NULL, &ts);
+    }
+  return rc;
+}
+
+/* The spawn backend: run "xscreensaver-command -VERB" against the display
+   of every session that has run_p set.  The commands all run in parallel,
+   so with several sessions this costs about as long as the slowest one,
+   not their sum.
+ */
+static void
+xscreensaver_command_spawn (struct handler_ctx *ctx,
+                            enum xscreensaver_verb verb)
+{
+  struct session_ctx *s;
+  char arg[32];
+  char *av[4];
+  uint64_t start;
+
+  xscreensaver_command_argv (verb, arg, av);
+  start = xscreensaver_usec();
+
+  xscreensaver_reap_abandoned (ctx);
+
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    {
+      if (!s->run_p)
+        continue;
+      s->run_p = 0;
+      ctx->stats.commands[verb]++;
+      xlog (LOG_DEBUG, "exec: %s %s %s (session \"%s\", display %s)",
+            av[0], av[1], av[2], s->id, s->display ? s->display : "unset");
+
+      s->pid = fork ();
+      if (s->pid == 0)
+        {
+          sigset_t none;        /* Whatever the loop blocked */
+          sigemptyset (&none);
+          sigprocmask (SIG_SETMASK, &none, NULL);
+          if (s->display)
+            setenv ("DISPLAY", s->display, 1);
+          execvp (av[0], av);
+          _exit (127);
+        }
+      else if (s->pid < 0)
+        {
+          xlog (LOG_WARNING, "exec failed: %s: %s", av[0], strerror(errno));
+          s->pid = 0;
+          xscreensaver_command_done (ctx, s, verb, -1,
+                                     xscreensaver_usec() - start);
+        }
+    }
+
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    {
+      int status = 0;
+      int rc;
+
+      if (!s->pid)
+        continue;
+      rc = xscreensaver_waitpid (ctx, s->pid, &status);
+      if (rc == 0)
+        {
+          xlog (LOG_WARNING, "exec: \"xscreensaver-command -%s\" still "
+                "running after %lu ms, not waiting for it",
+                xscreensaver_verbs[verb],
+                (unsigned long) ((xscreensaver_usec() - start) / 1000));
+          /* Reaped next time.  If there are too many, it stays a zombie
+             until we exit, which is better than reaping someone else's. */
+          if (ctx->nabandoned < MAX_ABANDONED)
+            ctx->abandoned[ctx->nabandoned++] = s->pid;
+        }
+      s->pid = 0;
+
+      xscreensaver_command_done (ctx, s, verb,
+                                 (rc <= 0 || !WIFEXITED(status)
+                                  ? -1 : WEXITSTATUS(status)),
+                                 xscreensaver_usec() - start);
+    }
+}
+
+/* Gets "-VERB" to every session that has run_p set, trying the backends
+   in order of cost.  Whatever one of them could not deliver falls through
+   to the next.  Fork and exec needs nothing of ours, so it is always on
+   the list, and nothing gets past it.  Until the backends have been
+   timed, only the ways that run xscreensaver-command itself are used.
+ */
+static void
+xscreensaver_command_selected (struct handler_ctx *ctx,
+                               enum xscreensaver_verb verb)
+{
+  static const enum command_backend defaults[] = {
+    BACKEND_HELPER, BACKEND_SPAWN
+  };
+  const enum command_backend *order = (ctx->nbackends ? ctx->backends
+                                       : defaults);
+  int n = (ctx->nbackends ? ctx->nbackends
+           : (int) (sizeof(defaults) / sizeof(*defaults)));
+  struct session_ctx *s;
+  int i;
+
+  TRACE1 (command_start, xscreensaver_verbs[verb]);
+
+  ctx->command_deadline = 0;
+  if (verb == XSS_SUSPEND && config->suspend_deadline_ms)
+    ctx->command_deadline = (xscreensaver_usec() +
+                             config->suspend_deadline_ms * (uint64_t) 1000);
+
+  if (dry_run_p)
+    {
+      LIST_FOREACH (s, &ctx->sessions, entries)
+        if (s->run_p)
+          {
+            s->run_p = 0;
+            ctx->stats.commands[verb]++;
+            if (virtual_clock_p)
+              {
+                uint64_t t = xscreensaver_usec() - virtual_epoch;
+                printf ("%7lu.%03lu command %s session \"%s\"\n",
+                        (unsigned long) (t / 1000000),
+                        (unsigned long) (t / 1000 % 1000),
+                        xscreensaver_verbs[verb], s->id);
+              }
+            xscreensaver_command_done (ctx, s, verb, 0, 0);
+          }
+      return;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      enum command_backend b = order[i];
+      int before = 0, after = 0;
+
+      LIST_FOREACH (s, &ctx->sessions, entries)
+        before += s->run_p;
+      if (!before)
+        break;
+
+      switch (b)
+        {
+        case BACKEND_X:
+          xscreensaver_command_x (ctx, verb);
+          break;
+        case BACKEND_HELPER:
+          if (ctx->helper_fd >= 0)
+            xscreensaver_command_helper (ctx, verb);
+          break;
+        default:
+          xscreensaver_command_spawn (ctx, verb);
+          break;
+        }
+
+      LIST_FOREACH (s, &ctx->sessions, entries)
+        after += s->run_p;
+      ctx->stats.backend_commands[b] += before - after;
+      if (after && ctx->nbackends)
+        {
+          ctx->stats.backend_fallbacks[b] += after;
+          xlog (LOG_INFO, "%s backend could not run -%s for %d session%s, "
+                "falling back", backend_names[b], xscreensaver_verbs[verb],
+                after, after == 1 ? "" : "s");
+        }
+    }
+}
+
+/* Run a command for one session, or for all of them if 'only' is NULL. */
+static void
+xscreensaver_command (struct handler_ctx *ctx, struct session_ctx *only,
+                      enum xscreensaver_verb verb)
+{
+  struct session_ctx *s;
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    s->run_p = (!only || s == only);
+  xscreensaver_command_selected (ctx, verb);
+}
+
+/* Times each backend by sending the harmless "-version" to the default
+   session, and puts the ones that answered in order of cost.  Each is
+   timed from asking to hearing back from xscreensaver, as a real
+   command would be: the spawned ones run xscreensaver-command, which
+   opens the display and reads xscreensaver's window, and the X one
+   sends a command that xscreensaver answers with an error.  As that is
+   a ping and not a real command, its cost is reported as "x_ping".  A
+   backend with no answer within CALIBRATE_USEC is left out: the event
+   loop waits for us.  Run at startup and by the Calibrate method.
+ */
+#define CALIBRATE_USEC 500000
+
+static const char * const calibrate_names[BACKEND_NBACKENDS] = {
+  "x_ping", "helper", "spawn"
+};
+
+static void
+xscreensaver_calibrate (struct handler_ctx *ctx)
+{
+  struct session_ctx *s, *probe = ctx->default_session;
+  uint64_t cost[BACKEND_NBACKENDS];
+  char report[200];
+  int b, i, n = 0;
+
+  if (!probe)
+    return;
+
+  for (b = 0; b < BACKEND_NBACKENDS; b++)
+    {
+      LIST_FOREACH (s, &ctx->sessions, entries)
+        s->run_p = (s == probe);
+      probe->status = -1;
+      ctx->command_deadline = xscreensaver_usec() + CALIBRATE_USEC;
+      switch (b)
+        {
+        case BACKEND_X:
+          xscreensaver_command_x (ctx, XSS_VERSION);
+          break;
+        case BACKEND_HELPER:
+          if (ctx->helper_fd >= 0)
+            xscreensaver_command_helper (ctx, XSS_VERSION);
+          break;
+        default:
+          xscreensaver_command_spawn (ctx, XSS_VERSION);
+          break;
+        }
+
+      ctx->stats.backend_usec[b] = 0;
+      cost[b] = UINT64_MAX;
+      if (!probe->run_p && probe->status == 0)
+        cost[b] = ctx->stats.backend_usec[b] = probe->usec ? probe->usec : 1;
+      probe->run_p = 0;
+      if (cost[b] == UINT64_MAX && b != BACKEND_SPAWN)
+        continue;
+
+      for (i = n; i > 0 && cost[ctx->backends[i-1]] > cost[b]; i--)
+        ctx->backends[i] = ctx->backends[i-1];
+      ctx->backends[i] = b;
+      n++;
+    }
+  ctx->nbackends = n;
+  ctx->command_deadline = 0;
+
+  *report = 0;
+  for (i = 0; i < n; i++)
+    sprintf (report + strlen (report), "%s%s %lu usec", i ? ", " : "",
+             calibrate_names[ctx->backends[i]],
+             (unsigned long) ctx->stats.backend_usec[ctx->backends[i]]);
+  xlog (LOG_INFO, "command backends: %s", report);
+}
+
+
+/* As xscreensaver_command(), but leaves out screens that xscreensaver
+   has told us are already locked.
+ */
+static void
+xscreensaver_command_unlocked (struct handler_ctx *ctx,
+                               struct session_ctx *only,
+                               enum xscreensaver_verb verb)
+{
+  struct session_ctx *s;
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    {
+      s->run_p = (!only || s == only);
+      if (s->run_p && xscreensaver_x_locked_p (s))
+        {
+          xlog (LOG_DEBUG, "session \"%s\": already locked, not running %s",
+                s->id, xscreensaver_verbs[verb]);
+          ctx->stats.commands_skipped++;
+          s->run_p = 0;
+        }
+    }
+  xscreensaver_command_selected (ctx, verb);
+}
+
+
+static struct session_ctx *
+xscreensaver_session_find (struct handler_ctx *ctx, const char *id)
+{
+  struct session_ctx *s;
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    if (!strcmp (s->id, id))
+      return s;
+  return NULL;
+}
+
+static struct session_ctx *
+xscreensaver_session_by_display (struct handler_ctx *ctx,
+                                 const char *display)
+{
+  struct session_ctx *s;
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    if (s->display && !strcmp (s->display, display))
+      return s;
+  return NULL;
+}
+
+static struct session_ctx *
+xscreensaver_session_add (struct handler_ctx *ctx, const char *id,
+                          const char *display, const char *path)
+{
+  struct session_ctx *s = calloc (1, sizeof (*s));
+  s->id = strdup (id ? id : "");
+  s->path = path ? strdup (path) : NULL;
+  s->display = (display && *display) ? strdup (display) : NULL;
+  LIST_INIT (&s->inhibitors);
+  LIST_INSERT_HEAD (&ctx->sessions, s, entries);
+  ctx->nsessions++;
+  if (!ctx->default_session)
+    ctx->default_session = s;
+  xlog (LOG_INFO, "session \"%s\": display %s", s->id,
+        s->display ? s->display : "$DISPLAY");
+  xscreensaver_x_open (s);
+  return s;
+}
+
+/* Leases are kept in a binary min-heap ordered by expiry, so the next
+   deadline is always ctx->leases[0], and adding, renewing, expiring or
+   cancelling one costs O(log n).  Each entry remembers where it is in
+   the heap so that it can be taken out of the middle.
+ */
+
+static void
+lease_heap_set (struct handler_ctx *ctx, int i, struct inhibit_entry *entry)
+{
+  ctx->leases[i] = entry;
+  entry->heap_index = i;
+}
+
+static void
+lease_heap_up (struct handler_ctx *ctx, int i)
+{
+  struct inhibit_entry *entry = ctx->leases[i];
+  while (i > 0)
+    {
+      int parent = (i - 1) / 2;
+      if (ctx->leases[parent]->expires <= entry->expires)
+        break;
+      lease_heap_set (ctx, i, ctx->leases[parent]);
+      i = parent;
+    }
+  lease_heap_set (ctx, i, entry);
+}
+
+static void
+lease_heap_down (struct handler_ctx *ctx, int i)
+{
+  struct inhibit_entry *entry = ctx->leases[i];
+  while (1)
+    {
+      int child = 2 * i + 1;
+      if (child >= ctx->nleases)
+        break;
+      if (child + 1 < ctx->nleases &&
+          ctx->leases[child + 1]->expires < ctx->leases[child]->expires)
+        child++;
+      if (entry->expires <= ctx->leases[child]->expires)
+        break;
+      lease_heap_set (ctx, i, ctx->leases[child]);
+      i = child;
+    }
+  lease_heap_set (ctx, i, entry);
+}
+
+static void
+lease_heap_insert (struct handler_ctx *ctx, struct inhibit_entry *entry)
+{
+  if (ctx->nleases >= ctx->leases_size)
+    {
+      ctx->leases_size = ctx->leases_size ? ctx->leases_size * 2 : 64;
+      ctx->leases = realloc (ctx->leases,
+                             ctx->leases_size * sizeof (*ctx->leases));
+    }
+  lease_heap_set (ctx, ctx->nleases++, entry);
+  lease_heap_up (ctx, entry->heap_index);
+}
+
+static void
+lease_heap_remove (struct handler_ctx *ctx, struct inhibit_entry *entry)
+{
+  int i = entry->heap_index;
+  struct inhibit_entry *last;
+
+  if (i < 0)
+    return;
+  entry->heap_index = -1;
+  last = ctx->leases[--ctx->nleases];
+  if (last == entry)
+    return;
+  lease_heap_set (ctx, i, last);
+  lease_heap_up (ctx, i);
+  lease_heap_down (ctx, last->heap_index);
+}
+
+/* Push an entry's expiry out by another lease period. */
+static void
+lease_renew (struct handler_ctx *ctx, struct inhibit_entry *entry)
+{
+  entry->expires = xscreensaver_usec() + entry->lease_usec;
+  lease_heap_down (ctx, entry->heap_index);
+  ctx->stats.lease_renewals++;
+}
+
+static uint64_t
+lease_for_application (const char *application)
+{
+  int i;
+  for (i = 0; i < nlease_rules; i++)
+    if (!fnmatch (lease_rules[i].pattern, application, 0))
+      return lease_rules[i].usec;
+  for (i = 0; i < config->nleases; i++)
+    if (!fnmatch (config->leases[i].pattern, application, 0))
+      return config->leases[i].usec;
+  return 0;
+}
+
+/* Parses "PATTERN=SECONDS", from -lease or the config file. */
+static int
+lease_rule_parse (char *arg, struct lease_rule *rules, int *nrules)
+{
+  char *eq = strrchr (arg, '=');
+  char *end;
+  long secs;
+
+  if (!eq || eq == arg || *nrules >= MAX_LEASE_RULES)
+    return -1;
+  secs = strtol (eq + 1, &end, 10);
+  if (*end || end == eq + 1 || secs <= 0)
+    return -1;
+  *eq = 0;
+  rules[*nrules].pattern = arg;
+  rules[*nrules].usec = (uint64_t) secs * 1000000;
+  (*nrules)++;
+  return 0;
+}
+
+static int
+lease_rule_add (char *arg)
+{
+  return lease_rule_parse (arg, lease_rules, &nlease_rules);
+}
+
+
+/* Where the config file is: $XDG_CONFIG_HOME, or ~/.config. */
+static const char *
+config_dir (void)
+{
+  static char dir[PATH_MAX];
+  const char *xdg = getenv ("XDG_CONFIG_HOME");
+  const char *home = getenv ("HOME");
+  if (xdg && *xdg)
+    snprintf (dir, sizeof(dir), "%s", xdg);
+  else
+    snprintf (dir, sizeof(dir), "%s/.config", home ? home : "");
+  return dir;
+}
+
+static void
+config_free (struct config *c)
+{
+  if (!c || c == &default_config)
+    return;
+  free (c->text);
+  free (c);
+}
+
+static int
+config_level (const char *name)
+{
+  static const struct { const char *name; int level; } levels[] = {
+    { "debug", LOG_DEBUG }, { "info", LOG_INFO }, { "notice", LOG_NOTICE },
+    { "warning", LOG_WARNING }, { "err", LOG_ERR }
+  };
+  int i;
+  for (i = 0; i < (int) (sizeof(levels) / sizeof(*levels)); i++)
+    if (!strcmp (name, levels[i].name))
+      return levels[i].level;
+  return -1;
+}
+
+/* Parses the whole of 'text', which it keeps.  Returns NULL, having said
+   what was wrong, if any line is bad.
+ */
+static struct config *
+config_parse (const char *file, char *text)
+{
+  struct config *c = malloc (sizeof (*c));
+  char *line, *next;
+  int lineno = 0;
+
+  *c = default_config;
+  c->text = text;
+
+  for (line = text; line; line = next)
+    {
+      char *key, *value, *end;
+      long n;
+
+      lineno++;
+      next = strchr (line, '\n');
+      if (next)
+        *next++ = 0;
+      if ((end = strchr (line, '#')))
+        *end = 0;
+      key = line + strspn (line, " \t");
+      if (!*key)
+        continue;
+      value = strchr (key, '=');
+      if (!value)
+        goto BAD;
+      for (end = value; end > key && strchr (" \t=", end[-1]); end--)
+        ;
+      *end = 0;
+      value++;
+      value += strspn (value, " \t");
+      for (end = value + strlen (value);
+           end > value && strchr (" \t\r", end[-1]);
+           end--)
+        ;
+      *end = 0;
+      n = strtol (value, &end, 10);
+
+      if (!strcmp (key, "heartbeat") && !*end && n > 0)
+        c->heartbeat_secs = n;
+      else if (!strcmp (key, "heartbeat_hidden") &&
+               (!strcmp (value, "hold") || !strcmp (value, "run")))
+        c->hold_hidden_p = !strcmp (value, "hold");
+      else if (!strcmp (key, "inhibit_rate") && !*end && n >= 0)
+        c->inhibit_rate = n;
+      else if (!strcmp (key, "inhibit_burst") && !*end && n > 0)
+        c->inhibit_burst = n;
+      else if (!strcmp (key, "suspend_deadline") && !*end && n >= 0)
+        c->suspend_deadline_ms = n;
+      else if (!strcmp (key, "log_level") && config_level (value) >= 0)
+        c->log_level = config_level (value);
+      else if (!strcmp (key, "slow_callback") && !*end && n >= 0)
+        c->slow_callback_ms = n;
+      else if (!strcmp (key, "lease") &&
+               lease_rule_parse (value, c->leases, &c->nleases) == 0)
+        ;
+      else if (!strcmp (key, "ignore") && *value &&
+               c->nignores < MAX_IGNORE_RULES)
+        {
+          struct ignore_rule *rule = &c->ignores[c->nignores++];
+          end = value + strcspn (value, " \t");
+          rule->application = value;
+          rule->reason = NULL;
+          if (*end)
+            {
+              *end++ = 0;
+              rule->reason = end + strspn (end, " \t");
+            }
+        }
+      else
+        goto BAD;
+    }
+  return c;
+
+ BAD:
+  xlog (LOG_WARNING, "%s:%d: bad setting, keeping the old config",
+        file, lineno);
+  c->text = NULL;       /* Still the caller's */
+  config_free (c);
+  return NULL;
+}
+
+/* Reads the config file, if there is one, and switches to it.  No file
+   means the defaults; a bad one means no change.  Returns -1 for that.
+ */
+static int
+config_load (void)
+{
+  char file[PATH_MAX + sizeof(CONFIG_FILE) + 1];
+  const struct config *old = config;
+  struct config *c = NULL;
+  FILE *in;
+
+  snprintf (file, sizeof(file), "%s/%s", config_dir(), CONFIG_FILE);
+  in = fopen (file, "r");
+  if (in)
+    {
+      char *text = NULL;
+      size_t size = 0, len = 0, n;
+      do
+        {
+          if (len + 1024 >= size)
+            text = realloc (text, size = size * 2 + 1024);
+          n = fread (text + len, 1, size - len - 1, in);
+          len += n;
+        }
+      while (n > 0);
+      fclose (in);
+      text[len] = 0;
+      c = config_parse (file, text);
+      if (!c)
+        {
+          free (text);
+          return -1;
+        }
+    }
+  else if (errno != ENOENT)
+    {
+      xlog (LOG_WARNING, "%s: %s, keeping the old config", file,
+            strerror(errno));
+      return -1;
+    }
+
+  config = c ? c : &default_config;
+  config_free ((struct config *) old);
+  if (!verbose_p)
+    log_level = config->log_level;
+  xlog (LOG_INFO, "config: %s: heartbeat %d sec, %d lease and %d ignore "
+        "rules", c ? file : "defaults", config->heartbeat_secs,
+        config->nleases, config->nignores);
+  return 0;
+}
+
+static int config_dir_wd = -1;         /* The directory the file is in */
+static int config_parent_wd = -1;      /* Its parent, until it exists */
+
+/* Splits config_dir() into its parent and last component. */
+static const char *
+config_dir_parent (const char **name)
+{
+  static char parent[PATH_MAX], base[PATH_MAX];
+  char *slash;
+  size_t len;
+
+  snprintf (parent, sizeof(parent), "%s", config_dir());
+  for (len = strlen (parent); len > 1 && parent[len - 1] == '/'; len--)
+    parent[len - 1] = 0;
+  slash = strrchr (parent, '/');
+  snprintf (base, sizeof(base), "%s", slash ? slash + 1 : parent);
+  *name = base;
+  if (!slash)
+    return ".";
+  if (slash == parent)
+    slash++;
+  *slash = 0;
+  return parent;
+}
+
+/* Watches the config directory or, if it does not exist yet, its parent
+   so that we notice when it is made.  Returns whether the directory
+   itself is now watched.  A parent that is missing too is not waited
+   for: the config is then only read at startup.
+ */
+static int
+config_watch_dir (int fd)
+{
+  const char *parent, *name;
+
+  config_dir_wd = inotify_add_watch (fd, config_dir(),
+                                     IN_CLOSE_WRITE | IN_MOVED_TO |
+                                     IN_MOVED_FROM | IN_DELETE);
+  if (config_dir_wd >= 0)
+    {
+      if (config_parent_wd >= 0)
+        inotify_rm_watch (fd, config_parent_wd);
+      config_parent_wd = -1;
+      return 1;
+    }
+  if (errno != ENOENT)
+    {
+      xlog (LOG_INFO, "not watching %s for config changes: %s",
+            config_dir(), strerror(errno));
+      return 0;
+    }
+  if (config_parent_wd >= 0)
+    return 0;
+
+  parent = config_dir_parent (&name);
+  config_parent_wd = inotify_add_watch (fd, parent,
+                                        IN_CREATE | IN_MOVED_TO |
+                                        IN_ONLYDIR);
+  if (config_parent_wd < 0)
+    xlog (LOG_INFO, "not watching %s for config changes: %s",
+          parent, strerror(errno));
+  else
+    xlog (LOG_DEBUG, "%s does not exist yet, watching %s for it",
+          config_dir(), parent);
+  return 0;
+}
+
+/* An inotify fd that becomes readable when the config file may have
+   changed.  We watch the directory, since editors replace files rather
+   than write them in place.
+ */
+static int
+config_watch (void)
+{
+  int fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0)
+    {
+      xlog (LOG_WARNING, "inotify: %s", strerror(errno));
+      return -1;
+    }
+  if (!config_watch_dir (fd) && config_parent_wd < 0)
+    {
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+/* Reads what inotify has for us.  Returns true if any of it was about
+   the config file.  A config directory that has just been made may
+   already hold the file, so that counts too; one that has gone away is
+   waited for again.
+ */
+static int
+config_changed_p (int fd)
+{
+  char buf[4096];
+  ssize_t n;
+  int hit = 0;
+  while ((n = read (fd, buf, sizeof(buf))) > 0)
+    {
+      char *p = buf;
+      while (p < buf + n)
+        {
+          struct inotify_event *e = (struct inotify_event *) p;
+          const char *name;
+          if (e->wd == config_parent_wd)
+            {
+              config_dir_parent (&name);
+              if (e->len && !strcmp (e->name, name) && config_watch_dir (fd))
+                hit = 1;
+            }
+          else if (e->wd == config_dir_wd && (e->mask & IN_IGNORED))
+            {
+              config_dir_wd = -1;
+              config_watch_dir (fd);
+            }
+          else if (e->len && !strcmp (e->name, CONFIG_FILE))
+            hit = 1;
+          p += sizeof(*e) + e->len;
+        }
+    }
+  return hit;
+}
+
+static struct inhibit_entry *
+inhibit_entry_find (struct handler_ctx *ctx, uint32_t cookie)
+{
+  struct inhibit_entry *entry;
+  LIST_FOREACH (entry, &ctx->by_cookie[INHIBIT_HASH(cookie)], by_cookie)
+    if (entry->cookie == cookie)
+      return entry;
+  return NULL;
+}
+
+static void
+inhibit_entry_free (struct inhibit_entry *entry)
+{
+  free (entry->application);
+  free (entry->reason);
+  free (entry->owner);
+  free (entry);
+}
+
+/* Adds 'delta' to the counters for each of the entry's flags.  The block
+   lock follows the suspend count from the event loop, so that a burst of
+   calls costs at most one round trip to logind.
+ */
+static void
+xscreensaver_inhibit_count (struct handler_ctx *ctx,
+                            struct inhibit_entry *entry, int delta)
+{
+  int i;
+  ctx->ninhibitors += delta;
+  for (i = 0; i < INHIBIT_NFLAGS; i++)
+    if (entry->flags & (1 << i))
+      ctx->inhibit_flags[i] += delta;
+  if (entry->flags & INHIBIT_IDLE)
+    {
+      entry->session->is_inhibited += delta;
+      ctx->is_inhibited += delta;
+    }
+}
+
+/* Takes an inhibitor out of its session, the cookie hash, the lease
+   heap and the fd list, and frees it.
+ */
+static void
+inhibit_entry_drop (struct handler_ctx *ctx, struct inhibit_entry *entry)
+{
+  LIST_REMOVE (entry, entries);
+  LIST_REMOVE (entry, by_cookie);
+  lease_heap_remove (ctx, entry);
+  if (entry->fd >= 0)
+    {
+      LIST_REMOVE (entry, by_fd);
+      ctx->nfd_inhibitors--;
+      close (entry->fd);
+    }
+  xscreensaver_inhibit_count (ctx, entry, -1);
+  inhibit_entry_free (entry);
+}
+
+/* Drops every inhibitor whose lease has run out by 'now'. */
+static void
+lease_expire (struct handler_ctx *ctx, uint64_t now)
+{
+  while (ctx->nleases && ctx->leases[0]->expires <= now)
+    {
+      struct inhibit_entry *entry = ctx->leases[0];
+      struct xlog_fields f;
+
+      f.mask = XLOG_COOKIE | XLOG_APP;
+      f.cookie = entry->cookie;
+      f.app = entry->application;
+      xlog_event (LOG_NOTICE, &f,
+                  "lease on inhibitor %u from '%s' expired, dropping it",
+                  entry->cookie, entry->application);
+      ctx->stats.leases_expired++;
+      inhibit_entry_drop (ctx, entry);
+    }
+}
+
+static void
+xscreensaver_session_remove (struct handler_ctx *ctx, struct session_ctx *s)
+{
+  struct inhibit_entry *entry;
+  int dropped = 0;
+
+  while ((entry = LIST_FIRST (&s->inhibitors)))
+    {
+      inhibit_entry_drop (ctx, entry);
+      dropped++;
+    }
+  xlog (LOG_INFO, "session \"%s\" gone, dropped %d inhibitors",
+        s->id, dropped);
+
+  LIST_REMOVE (s, entries);
+  ctx->nsessions--;
+  if (ctx->default_session == s)
+    ctx->default_session = LIST_FIRST (&ctx->sessions);
+  xscreensaver_x_close (s);
+  free (s->id);
+  free (s->path);
+  free (s->display);
+  free (s);
+}
+
+/* Look at a logind session, and start looking after it if it is ours
+   and has an X display.
+ */
+static void
+xscreensaver_session_probe (struct handler_ctx *ctx, const char *id,
+                            const char *path)
+{
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *reply = NULL;
+  char *display = NULL;
+  const char *user_path;
+  struct session_ctx *s;
+  uint32_t uid;
+  int rc;
+
+  if (xscreensaver_session_find (ctx, id))
+    return;
+
+  rc = sd_bus_get_property (ctx->system_bus, DBUS_SD_SERVICE_NAME, path,
+                            DBUS_SD_SESSION_INTERFACE, "User",
+                            &error, &reply, "(uo)");
+  if (rc < 0)
+    goto DONE;
+  rc = sd_bus_message_read (reply, "(uo)", &uid, &user_path);
+  if (rc < 0 || uid != getuid())
+    goto DONE;
+
+  rc = sd_bus_get_property_string (ctx->system_bus, DBUS_SD_SERVICE_NAME,
+                                   path, DBUS_SD_SESSION_INTERFACE,
+                                   "Display", &error, &display);
+  if (rc < 0 || !display || !*display)
+    goto DONE;
+
+  /* One session per display, or every command would go to it twice.
+     Without XDG_SESSION_ID, the one we were started in has no id yet,
+     and this is where it gets one. */
+  if ((s = xscreensaver_session_by_display (ctx, display)))
+    {
+      if (!*s->id)
+        {
+          free (s->id);
+          s->id = strdup (id);
+          if (!s->path)
+            s->path = strdup (path);
+          xlog (LOG_INFO, "session \"%s\": display %s, started here",
+                s->id, display);
+        }
+      else
+        xlog (LOG_DEBUG, "session \"%s\": display %s is already "
+              "session \"%s\"", id, display, s->id);
+      goto DONE;
+    }
+
+  xscreensaver_session_add (ctx, id, display, path);
+
+ DONE:
+  if (rc < 0)
+    xlog (LOG_DEBUG, "session \"%s\": %s", id,
+          error.message ? error.message : strerror(-rc));
+  free (display);
+  if (reply)
+    sd_bus_message_unref (reply);
+  sd_bus_error_free (&error);
+}
+
+/* Find all of our graphical sessions that logind already knows about. */
+static int
+xscreensaver_discover_sessions (struct handler_ctx *ctx)
+{
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *reply = NULL;
+  const char *id, *user, *seat, *path;
+  uint32_t uid;
+  int rc;
+
+  rc = sd_bus_call_method (ctx->system_bus,
+                           DBUS_SD_SERVICE_NAME, DBUS_SD_OBJECT_PATH,
+                           DBUS_SD_INTERFACE, "ListSessions",
+                           &error, &reply, "");
+  if (rc < 0)
+    {
+      xlog (LOG_WARNING, "dbus: ListSessions failed: %s", error.message);
+      goto DONE;
+    }
+
+  rc = sd_bus_message_enter_container (reply, 'a', "(susso)");
+  if (rc < 0)
+    goto DONE;
+  while ((rc = sd_bus_message_read (reply, "(susso)",
+                                    &id, &uid, &user, &seat, &path)) > 0)
+    if (uid == getuid())
+      xscreensaver_session_probe (ctx, id, path);
+  if (rc >= 0)
+    rc = sd_bus_message_exit_container (reply);
+
+ DONE:
+  if (reply)
+    sd_bus_message_unref (reply);
+  sd_bus_error_free (&error);
+  return rc;
+}
+
+/* Called when DBUS_SD_INTERFACE sends "SessionNew" or "SessionRemoved". */
+static int
+xscreensaver_session_handler (sd_bus_message *m, void *arg,
+                              sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  const char *id, *path;
+  struct session_ctx *s;
+  int rc;
+
+  rc = sd_bus_message_read (m, "so", &id, &path);
+  if (rc < 0)
+    {
+      xlog (LOG_WARNING, "dbus: message read failed: %s", strerror(-rc));
+      return 1;
+    }
+
+  if (!strcmp (sd_bus_message_get_member (m), "SessionNew"))
+    xscreensaver_session_probe (ctx, id, path);
+  else if ((s = xscreensaver_session_find (ctx, id)) &&
+           s != ctx->default_session)
+    /* The session we were started in stays for as long as we do. */
+    xscreensaver_session_remove (ctx, s);
+
+  return 1;
+}
+
+/* Find the logind object path of a session we were told about by
+   environment variables rather than by logind itself.
+ */
+static void
+xscreensaver_session_resolve_path (struct handler_ctx *ctx,
+                                   struct session_ctx *s)
+{
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *reply = NULL;
+  const char *path;
+  int rc;
+
+  if (*s->id)
+    rc = sd_bus_call_method (ctx->system_bus,
+                             DBUS_SD_SERVICE_NAME, DBUS_SD_OBJECT_PATH,
+                             DBUS_SD_INTERFACE, "GetSession",
+                             &error, &reply, "s", s->id);
+  else
+    rc = sd_bus_call_method (ctx->system_bus,
+                             DBUS_SD_SERVICE_NAME, DBUS_SD_OBJECT_PATH,
+                             DBUS_SD_INTERFACE, "GetSessionByPID",
+                             &error, &reply, "u", (uint32_t) getpid());
+  if (rc >= 0)
+    rc = sd_bus_message_read (reply, "o", &path);
+  if (rc >= 0)
+    {
+      free (s->path);
+      s->path = strdup (path);
+    }
+  else
+    xlog (LOG_INFO, "session \"%s\": not a logind session, "
+          "Lock/Unlock will be ignored: %s", s->id,
+          error.message ? error.message : strerror(-rc));
+
+  if (reply)
+    sd_bus_message_unref (reply);
+  sd_bus_error_free (&error);
+}
+
+#ifdef HAVE_X11
+
+static int
+xscreensaver_idle_hint_done (sd_bus_message *m, void *arg,
+                             sd_bus_error *ret_error)
+{
+  if (sd_bus_message_is_method_error (m, NULL))
+    xlog (LOG_WARNING, "dbus: SetIdleHint failed: %s",
+          sd_bus_message_get_error (m)->message);
+  return 1;
+}
+
+/* Tells logind whether the session is idle, meaning blanked or locked,
+   if that has changed since we last said.  Called from the top of the
+   loop, after the X events that would have changed it.  The reply is
+   only looked at for errors.
+ */
+static void
+xscreensaver_idle_hint (struct handler_ctx *ctx, struct session_ctx *s)
+{
+  int idle = s->saver_state != 0;
+  int rc;
+
+  if (!s->dpy || !s->path || !ctx->logind_owner || idle == s->idle_hint ||
+      ctx->standby_waiting_p)
+    return;
+  rc = sd_bus_call_method_async (ctx->system_bus, NULL,
+                                 DBUS_SD_SERVICE_NAME, s->path,
+                                 DBUS_SD_SESSION_INTERFACE, "SetIdleHint",
+                                 xscreensaver_idle_hint_done, ctx,
+                                 "b", idle);
+  if (rc < 0)
+    {
+      xlog (LOG_WARNING, "dbus: SetIdleHint failed: %s", strerror(-rc));
+      return;
+    }
+  xlog (LOG_DEBUG, "session \"%s\": idle hint %s", s->id,
+        idle ? "on" : "off");
+  s->idle_hint = idle;
+  ctx->stats.idle_hints++;
+}
+
+/* On the way out: once we are gone nobody will clear the hint when the
+   screen unblanks, and logind could go on to IdleAction on a session
+   that is in use.  The calls go out when the caller flushes the bus.
+ */
+static void
+xscreensaver_idle_hint_clear (struct handler_ctx *ctx)
+{
+  struct session_ctx *s;
+
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    if (s->idle_hint == 1 && s->path && ctx->logind_owner &&
+        sd_bus_call_method_async (ctx->system_bus, NULL,
+                                  DBUS_SD_SERVICE_NAME, s->path,
+                                  DBUS_SD_SESSION_INTERFACE, "SetIdleHint",
+                                  NULL, NULL, "b", 0) >= 0)
+      {
+        xlog (LOG_DEBUG, "session \"%s\": idle hint off", s->id);
+        s->idle_hint = 0;
+        ctx->stats.idle_hints++;
+      }
+}
+
+#else  /* !HAVE_X11 */
+# define xscreensaver_idle_hint(ctx,s) do { } while (0)
+# define xscreensaver_idle_hint_clear(ctx) do { } while (0)
+#endif /* !HAVE_X11 */
+
+static struct session_ctx *
+xscreensaver_session_by_path (struct handler_ctx *ctx, const char *path)
+{
+  struct session_ctx *s;
+  if (!path)
+    return NULL;
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    if (s->path && !strcmp (s->path, path))
+      return s;
+  return NULL;
+}
+
+/* Which session an Inhibit call is on behalf of.  Only worth asking the
+   bus when there is more than one to choose from.
+ */
+static struct session_ctx *
+xscreensaver_session_for_message (struct handler_ctx *ctx, sd_bus_message *m)
+{
+  sd_bus_creds *creds = NULL;
+  struct session_ctx *s = NULL;
+  const char *id;
+
+  if (ctx->nsessions > 1 &&
+      sd_bus_query_sender_creds (m, SD_BUS_CREDS_SESSION |
+                                 SD_BUS_CREDS_AUGMENT, &creds) >= 0 &&
+      sd_bus_creds_get_session (creds, &id) >= 0)
+    s = xscreensaver_session_find (ctx, id);
+  if (creds)
+    sd_bus_creds_unref (creds);
+  return s ? s : ctx->default_session;
+}
+
+
+/* Take a delay lock from logind's "Inhibit" method. */
+static int
+xscreensaver_take_lock (struct handler_ctx *ctx, struct logind_lock *lock)
+{
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *reply = NULL;
+  int fd = -1;
+  int rc = sd_bus_call_method (ctx->system_bus,
+                               DBUS_SD_SERVICE_NAME, DBUS_SD_OBJECT_PATH,
+                               DBUS_SD_INTERFACE, DBUS_SD_METHOD,
+                               &error, &reply,
+                               DBUS_SD_METHOD_ARGS,
+                               lock->what, DBUS_SD_METHOD_WHO,
+                               lock->why, lock->mode);
+  if (rc < 0)
+    {
+      xlog (LOG_ERR, "dbus: inhibit %s failed: %s", lock->what,
+            error.message);
+      goto DONE;
+    }
+
+  /* Save the lock fd and explicitly take a ref to the lock message. */
+  rc = sd_bus_message_read (reply, "h", &fd);
+  if (rc < 0 || fd < 0)
+    {
+      xlog (LOG_ERR, "dbus: inhibit %s failed: no lock fd: %s", lock->what,
+            strerror(-rc));
+      goto DONE;
+    }
+  sd_bus_message_ref(reply);
+  lock->message = reply;
+  lock->fd = fd;
+
+ DONE:
+  sd_bus_error_free (&error);
+  return rc < 0 ? rc : fd;
+}
+
+/* Release a delay lock, meaning we are done and logind may go ahead.
+   Don't rely on unref'ing the message to close the fd, do that
+   explicitly here.
+ */
+static int
+xscreensaver_release_lock (struct logind_lock *lock)
+{
+  if (!lock->message)
+    return 0;
+  close (lock->fd);
+  sd_bus_message_unref (lock->message);
+  lock->message = NULL;
+  lock->fd = -1;
+  return 1;
+}
+
+static void
+xscreensaver_sleep_state (struct handler_ctx *ctx, enum sleep_state state)
+{
+  uint64_t now = xscreensaver_usec();
+
+  ctx->stats.sleep_state_usec[ctx->sleep_state] +=
+    now - ctx->sleep_state_since;
+  ctx->stats.sleep_state_count[state]++;
+  if (state != ctx->sleep_state)
+    xlog (LOG_DEBUG, "sleep lock: %s -> %s",
+          sleep_state_names[ctx->sleep_state], sleep_state_names[state]);
+  ctx->sleep_state = state;
+  ctx->sleep_state_since = now;
+}
+
+/* The reply to our Inhibit call for the sleep lock. */
+static int
+xscreensaver_sleep_acquired (sd_bus_message *m, void *arg,
+                             sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  struct logind_lock *lock = &ctx->sleep_lock;
+  uint64_t usec = xscreensaver_usec() - ctx->sleep_acquire_start;
+  int fd = -1;
+  int rc;
+
+  ctx->sleep_acquire_pending = 0;
+  if (sd_bus_message_is_method_error (m, NULL))
+    {
+      rc = -sd_bus_message_get_errno (m);
+      xlog (LOG_ERR, "dbus: inhibit %s failed: %s", lock->what,
+            sd_bus_message_get_error (m)->message);
+    }
+  else
+    {
+      rc = sd_bus_message_read (m, "h", &fd);
+      if (rc >= 0 && fd < 0)
+        rc = -EBADF;
+      if (rc < 0)
+        xlog (LOG_ERR, "dbus: inhibit %s failed: no lock fd: %s",
+              lock->what, strerror(-rc));
+    }
+  TRACE3 (register_sleep_lock, rc, fd, usec);
+
+  if (rc < 0)
+    {
+      ctx->stats.sleep_acquire_failed++;
+      ctx->sleep_retry_at = xscreensaver_usec() + SLEEP_RETRY_USEC;
+      if (ctx->sleep_state == SLEEP_ACQUIRING)
+        xscreensaver_sleep_state (ctx, SLEEP_IDLE);
+      return 1;
+    }
+
+  switch (ctx->sleep_state)
+    {
+    case SLEEP_ACQUIRING:
+    case SLEEP_RESUMING:
+    case SLEEP_IDLE:
+      /* Same as xscreensaver_take_lock(): the message owns the fd. */
+      lock->message = sd_bus_message_ref (m);
+      lock->fd = fd;
+      if (ctx->sleep_state != SLEEP_RESUMING)
+        xscreensaver_sleep_state (ctx, SLEEP_HELD);
+      break;
+    default:
+      /* Sleep started while we were asking.  Holding it now would only
+         hold up the sleep that is already under way, so let the reply,
+         and the fd in it, go; we ask again on resume. */
+      xlog (LOG_INFO, "sleep lock arrived while %s, dropping it",
+            sleep_state_names[ctx->sleep_state]);
+      break;
+    }
+  return 1;
+}
+
+/* Ask logind for the sleep lock without waiting for the answer. */
+static void
+xscreensaver_sleep_acquire (struct handler_ctx *ctx)
+{
+  struct logind_lock *lock = &ctx->sleep_lock;
+  int rc;
+
+  if (ctx->sleep_acquire_pending || lock->message)
+    return;
+  ctx->sleep_retry_at = 0;
+  ctx->sleep_acquire_start = xscreensaver_usec();
+  rc = sd_bus_call_method_async (ctx->system_bus, NULL,
+                                 DBUS_SD_SERVICE_NAME, DBUS_SD_OBJECT_PATH,
+                                 DBUS_SD_INTERFACE, DBUS_SD_METHOD,
+                                 xscreensaver_sleep_acquired, ctx,
+                                 DBUS_SD_METHOD_ARGS,
+                                 lock->what, DBUS_SD_METHOD_WHO,
+                                 lock->why, lock->mode);
+  if (rc < 0)
+    {
+      xlog (LOG_ERR, "dbus: inhibit %s failed: %s", lock->what,
+            strerror(-rc));
+      ctx->stats.sleep_acquire_failed++;
+      ctx->sleep_retry_at = xscreensaver_usec() + SLEEP_RETRY_USEC;
+      if (ctx->sleep_state != SLEEP_RESUMING)
+        xscreensaver_sleep_state (ctx, SLEEP_IDLE);
+      return;
+    }
+  ctx->sleep_acquire_pending = 1;
+  if (ctx->sleep_state == SLEEP_IDLE || ctx->sleep_state == SLEEP_HELD)
+    xscreensaver_sleep_state (ctx, SLEEP_ACQUIRING);
+}
+
+/* Where to go once the resume commands are done. */
+static void
+xscreensaver_sleep_settle (struct handler_ctx *ctx)
+{
+  xscreensaver_sleep_state (ctx, (ctx->sleep_lock.message ? SLEEP_HELD :
+                                  ctx->sleep_acquire_pending
+                                  ? SLEEP_ACQUIRING : SLEEP_IDLE));
+}
+
+static void
+xscreensaver_account (struct handler_ctx *ctx, enum lock_trigger t,
+                      uint64_t start)
+{
+  struct xlog_fields f;
+  uint64_t usec = xscreensaver_usec() - start;
+
+  ctx->stats.triggers[t]++;
+  ctx->stats.trigger_usec[t] += usec;
+  if (usec > ctx->stats.trigger_usec_max[t])
+    ctx->stats.trigger_usec_max[t] = usec;
+
+  f.mask = XLOG_PHASE | XLOG_LATENCY;
+  f.phase = trigger_names[t];
+  f.latency_usec = usec;
+  xlog_event (LOG_INFO, &f, "%s handled in %lu usec",
+              trigger_names[t], (unsigned long) usec);
+}
+
+
+/* Resuming: see the comment at the top.  Each step is how long to wait
+   after a try that did not work.  The last try sends -deactivate even if
+   the display still does not look ready.
+ */
+static const unsigned int resume_retry_ms[] = {
+  100, 250, 500, 1000, 2000, 4000
+};
+#define RESUME_NSTEPS \
+  ((int) (sizeof(resume_retry_ms) / sizeof(*resume_retry_ms)))
+
+static int
+xscreensaver_resume_due_p (struct session_ctx *s, uint64_t now)
+{
+  return (s->resume_start &&
+          (s->resume_poked_p || s->resume_retry_at <= now));
+}
+
+/* Decides what comes after a try: done, the next step, or giving up. */
+static void
+xscreensaver_resume_step (struct handler_ctx *ctx, struct session_ctx *s,
+                          uint64_t now)
+{
+  struct xlog_fields f;
+  uint64_t usec = xscreensaver_usec() - s->resume_start;
+  int early = s->resume_poked_p && s->resume_retry_at > now;
+
+  s->resume_poked_p = 0;
+  if (s->resume_ready_p && s->status == 0)
+    {
+      ctx->stats.resume_ready++;
+      ctx->stats.resume_ready_usec += usec;
+      if (usec > ctx->stats.resume_ready_usec_max)
+        ctx->stats.resume_ready_usec_max = usec;
+      f.mask = XLOG_PHASE | XLOG_LATENCY;
+      f.phase = "resume_ready";
+      f.latency_usec = usec;
+      xlog_event (LOG_INFO, &f, "session \"%s\": unlock dialog requested "
+                  "%lu usec after resume, %d retries", s->id,
+                  (unsigned long) usec, s->resume_tries);
+      TRACE2 (resume_ready, s->resume_tries, usec);
+      s->resume_start = 0;
+    }
+  else if (s->resume_tries >= RESUME_NSTEPS)
+    {
+      xlog (LOG_WARNING, "session \"%s\": display still not ready "
+            "%lu ms after resume, giving up", s->id,
+            (unsigned long) (usec / 1000));
+      ctx->stats.resume_gave_up++;
+      s->resume_start = 0;
+    }
+  else if (!early)
+    {
+      /* A look taken because X told us something changed does not use
+         up a step. */
+      s->resume_retry_at = now + resume_retry_ms[s->resume_tries++] * 1000;
+      ctx->stats.resume_retries++;
+    }
+}
+
+/* Sends -deactivate, as one batch, to every session whose turn it is and
+   whose display is ready, or that has run out of steps.
+ */
+static void
+xscreensaver_resume_run (struct handler_ctx *ctx)
+{
+  struct session_ctx *s;
+  uint64_t now = xscreensaver_usec();
+  int n = 0;
+
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    {
+      s->run_p = 0;
+      if (!xscreensaver_resume_due_p (s, now))
+        continue;
+      s->resume_ready_p = xscreensaver_x_ready_p (s);
+      s->run_p = (s->resume_ready_p || s->resume_tries >= RESUME_NSTEPS);
+      s->status = -1;
+      n += s->run_p;
+    }
+  if (n)
+    xscreensaver_command_selected (ctx, XSS_DEACTIVATE);
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    if (xscreensaver_resume_due_p (s, now))
+      xscreensaver_resume_step (ctx, s, now);
+}
+
+static void
+xscreensaver_resume_start (struct handler_ctx *ctx, uint64_t start)
+{
+  struct session_ctx *s;
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    {
+      s->resume_start = start;
+      s->resume_retry_at = 0;
+      s->resume_tries = 0;
+      s->resume_poked_p = 0;
+    }
+  xscreensaver_resume_run (ctx);
+}
+
+/* Going back to sleep: whatever was still waiting can wait for the next
+   resume. */
+static void
+xscreensaver_resume_cancel (struct handler_ctx *ctx)
+{
+  struct session_ctx *s;
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    if (s->resume_start)
+      {
+        xlog (LOG_INFO, "session \"%s\": sleeping again before the "
+              "display was ready", s->id);
+        s->resume_start = 0;
+      }
+}
+
+
+/* Called when DBUS_SD_INTERFACE sends a "PrepareForSleep" signal.
+   The event is sent twice: before sleep, and after.
+ */
+static int
+xscreensaver_systemd_handler (sd_bus_message *m, void *arg,
+                              sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  int before_sleep;
+  int rc;
+  uint64_t start;
+
+  rc = sd_bus_message_read (m, "b", &before_sleep);
+  if (rc < 0)
+    {
+      xlog (LOG_WARNING, "dbus: message read failed: %s", strerror(-rc));
+      return 1;  /* >= 0 means success */
+    }
+
+  TRACE1 (sleep_start, before_sleep);
+  start = xscreensaver_usec();
+  xscreensaver_record (RECORD_SLEEP, before_sleep, 0, NULL, NULL);
+
+  /* Use the scheme described at
+     https://www.freedesktop.org/wiki/Software/systemd/inhibit/
+     under "Taking Delay Locks".
+
+     Before sleep, we lock whatever state we are in; if we do not hold
+     the lock (still asking, asking failed, or a resume went missing)
+     logind will not wait for us, but locking late beats not locking.
+     After sleep, we unlock and ask for the lock again unless we somehow
+     still have it.
+   */
+  if (before_sleep)
+    {
+      if (ctx->sleep_state != SLEEP_HELD)
+        {
+          xlog (LOG_WARNING, "sleeping while %s: locking anyway",
+                sleep_state_names[ctx->sleep_state]);
+          ctx->stats.sleep_out_of_order++;
+        }
+      xscreensaver_sleep_state (ctx, SLEEP_LOCKING);
+      xscreensaver_resume_cancel (ctx);
+
+      /* Tell xscreensaver that we are suspending, and to lock if desired.
+         On standby, the active copy does that: we only let go. */
+      if (!ctx->standby_waiting_p)
+        xscreensaver_command_unlocked (ctx, NULL, XSS_SUSPEND);
+
+      /* Release the lock, meaning we are done and it's ok to sleep now.
+         logind will not give out the next one until after resume. */
+      xscreensaver_release_lock (&ctx->sleep_lock);
+      xscreensaver_sleep_state (ctx, SLEEP_RELEASED);
+    }
+  else
+    {
+      if (ctx->sleep_state != SLEEP_RELEASED)
+        {
+          xlog (LOG_WARNING, "woke up while %s",
+                sleep_state_names[ctx->sleep_state]);
+          ctx->stats.sleep_out_of_order++;
+        }
+      xscreensaver_sleep_state (ctx, SLEEP_RESUMING);
+
+      /* We woke from sleep, so we need to re-register for the next sleep.
+         Ask first: the answer can be on its way while we run the command.
+         This is the earliest we can: logind turns away Inhibit("sleep")
+         until the sleep job is over, and it sends this signal as the job
+         ends.  A lid closed again meanwhile is ignored by logind anyway,
+         for HoldoffTimeoutSec after resume. */
+      xscreensaver_sleep_acquire (ctx);
+
+      /* Tell xscreensaver to present the unlock dialog, right now on
+         the displays that are ready for it, and on the rest once they
+         are. */
+      if (!ctx->standby_waiting_p)
+        xscreensaver_resume_start (ctx, start);
+      xscreensaver_sleep_settle (ctx);
+    }
+
+  TRACE2 (sleep_done, before_sleep, xscreensaver_usec() - start);
+  xscreensaver_account (ctx, before_sleep ? TRIGGER_SLEEP : TRIGGER_RESUME,
+                        start);
+  return 1;  /* >= 0 means success */
+}
+
+/* Called when DBUS_SD_INTERFACE sends a "PrepareForShutdown" signal.
+   As for sleep, but with its own delay lock.  The "after" half only
+   comes if the shutdown was cancelled.
+ */
+static int
+xscreensaver_shutdown_handler (sd_bus_message *m, void *arg,
+                               sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  int before_shutdown;
+  int rc;
+  uint64_t start;
+
+  rc = sd_bus_message_read (m, "b", &before_shutdown);
+  if (rc < 0)
+    {
+      xlog (LOG_WARNING, "dbus: message read failed: %s", strerror(-rc));
+      return 1;
+    }
+
+  start = xscreensaver_usec();
+  if (before_shutdown)
+    {
+      if (!ctx->standby_waiting_p)
+        xscreensaver_command_unlocked (ctx, NULL, XSS_LOCK);
+      xscreensaver_release_lock (&ctx->shutdown_lock);
+      xscreensaver_account (ctx, TRIGGER_SHUTDOWN, start);
+    }
+  else if (xscreensaver_take_lock (ctx, &ctx->shutdown_lock) < 0)
+    xlog (LOG_ERR, "could not re-register shutdown lock");
+
+  return 1;
+}
+
+/* Called when a session object sends "Lock" or "Unlock", e.g. from
+   "loginctl lock-session" or logind's IdleAction.
+ */
+static int
+xscreensaver_session_lock_handler (sd_bus_message *m, void *arg,
+                                   sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  struct session_ctx *s;
+  uint64_t start = xscreensaver_usec();
+  int lock_p;
+
+  s = xscreensaver_session_by_path (ctx, sd_bus_message_get_path (m));
+  if (!s || ctx->standby_waiting_p)
+    return 1;  /* Somebody else's session, or copy */
+
+  lock_p = !strcmp (sd_bus_message_get_member (m), "Lock");
+  if (lock_p)
+    xscreensaver_command_unlocked (ctx, s, XSS_LOCK);
+  else
+    xscreensaver_command (ctx, s, XSS_DEACTIVATE);
+  xscreensaver_account (ctx, lock_p ? TRIGGER_LOCK : TRIGGER_UNLOCK, start);
+  return 1;
+}
+
+/* Following logind.
+
+   Every signal we act on from logind is matched on its unique name as
+   well as on path and interface, so that a PrepareForSleep from anybody
+   else is dropped by the bus and never wakes us, let alone runs a
+   command.  The bus tells us with NameOwnerChanged when logind goes away
+   or comes back; its delay locks die with it, so when it comes back we
+   make our matches again for the new name and ask for the locks again.
+ */
+
+/* (Re)makes one match for the current owner, or drops it if there is
+   none. */
+static int
+xscreensaver_logind_match (struct handler_ctx *ctx, struct logind_match *lm)
+{
+  char match[512];
+
+  lm->slot = sd_bus_slot_unref (lm->slot);
+  if (!ctx->logind_owner)
+    return 0;
+  snprintf (match, sizeof(match), "sender='%s',%s", ctx->logind_owner,
+            lm->match);
+  return sd_bus_add_match (ctx->system_bus, &lm->slot, match, lm->handler,
+                           ctx);
+}
+
+/* sd_bus_add_match(), for a signal from logind. */
+static int
+xscreensaver_logind_watch (struct handler_ctx *ctx, const char *match,
+                           sd_bus_message_handler_t handler)
+{
+  struct logind_match *lm;
+
+  if (ctx->nlogind_matches >= LOGIND_MAX_MATCHES)
+    return -ENOBUFS;
+  lm = &ctx->logind_matches[ctx->nlogind_matches++];
+  lm->match = match;
+  lm->handler = handler;
+  lm->slot = NULL;
+  return xscreensaver_logind_match (ctx, lm);
+}
+
+static void
+xscreensaver_logind_lost (struct handler_ctx *ctx)
+{
+  int i;
+
+  xlog (LOG_WARNING, "logind (%s) went away", ctx->logind_owner);
+  free (ctx->logind_owner);
+  ctx->logind_owner = NULL;
+  for (i = 0; i < ctx->nlogind_matches; i++)
+    xscreensaver_logind_match (ctx, &ctx->logind_matches[i]);
+
+  /* Its locks went with it. */
+  xscreensaver_release_lock (&ctx->sleep_lock);
+  xscreensaver_release_lock (&ctx->shutdown_lock);
+  xscreensaver_release_lock (&ctx->block_lock);
+  if (ctx->sleep_state == SLEEP_HELD)
+    xscreensaver_sleep_state (ctx, SLEEP_IDLE);
+}
+
+static void
+xscreensaver_logind_found (struct handler_ctx *ctx, const char *owner,
+                           int restart_p)
+{
+  int i;
+
+  free (ctx->logind_owner);
+  ctx->logind_owner = strdup (owner);
+  xlog (restart_p ? LOG_NOTICE : LOG_DEBUG, "logind is %s", owner);
+  for (i = 0; i < ctx->nlogind_matches; i++)
+    if (xscreensaver_logind_match (ctx, &ctx->logind_matches[i]) < 0)
+      xlog (LOG_ERR, "dbus: add match failed: %s",
+            ctx->logind_matches[i].match);
+  if (!restart_p)
+    return;
+
+  /* Ask for whatever we hold at startup.  The "block" lock, and the idle
+     hints, come back by themselves from the top of the loop. */
+  ctx->stats.logind_restarts++;
+#ifdef HAVE_X11
+  {
+    struct session_ctx *s;
+    LIST_FOREACH (s, &ctx->sessions, entries)
+      s->idle_hint = -1;
+  }
+#endif
+  if (!inhibit_only_p)
+    {
+      xscreensaver_sleep_acquire (ctx);
+      xscreensaver_take_lock (ctx, &ctx->shutdown_lock);
+    }
+}
+
+static int
+xscreensaver_logind_owner_handler (sd_bus_message *m, void *arg,
+                                   sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  const char *name, *old_owner, *new_owner;
+
+  if (sd_bus_message_read (m, "sss", &name, &old_owner, &new_owner) < 0 ||
+      strcmp (name, DBUS_SD_SERVICE_NAME))
+    return 1;
+  if (*old_owner && ctx->logind_owner)
+    xscreensaver_logind_lost (ctx);
+  if (*new_owner)
+    xscreensaver_logind_found (ctx, new_owner, 1);
+  return 1;
+}
+
+/* Starts following logind's name, and finds out who has it now. */
+static int
+xscreensaver_logind_start (struct handler_ctx *ctx)
+{
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *reply = NULL;
+  const char *owner;
+  int rc;
+
+  rc = sd_bus_add_match (ctx->system_bus, NULL, DBUS_SD_OWNER_MATCH,
+                         xscreensaver_logind_owner_handler, ctx);
+  if (rc < 0)
+    {
+      warnx ("dbus: add match failed: %s", strerror(-rc));
+      return rc;
+    }
+
+  rc = sd_bus_call_method (ctx->system_bus, DBUS_DAEMON_NAME,
+                           DBUS_DAEMON_OBJECT_PATH, DBUS_DAEMON_INTERFACE,
+                           "GetNameOwner", &error, &reply, "s",
+                           DBUS_SD_SERVICE_NAME);
+  if (rc >= 0)
+    rc = sd_bus_message_read (reply, "s", &owner);
+  if (rc >= 0)
+    xscreensaver_logind_found (ctx, owner, 0);
+  else
+    xlog (LOG_WARNING, "logind is not running, waiting for it: %s",
+          error.message ? error.message : strerror(-rc));
+  sd_bus_message_unref (reply);
+  sd_bus_error_free (&error);
+  return 0;
+}
+
+/* The lid.  If UPower is there, it tells us when the lid opens and
+   closes, and we only have to ask logind about Docked when it closes.
+   Otherwise we ask logind about both each time a heartbeat is due.
+ */
+static int
+xscreensaver_get_bool (struct handler_ctx *ctx, const char *service,
+                       const char *path, const char *interface,
+                       const char *member, int *ret)
+{
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  int value = 0;
+  int rc = sd_bus_get_property_trivial (ctx->system_bus, service, path,
+                                        interface, member, &error, 'b',
+                                        &value);
+  sd_bus_error_free (&error);
+  if (rc >= 0)
+    *ret = value;
+  return rc;
+}
+
+static void
+xscreensaver_lid_changed (struct handler_ctx *ctx, int closed)
+{
+  struct session_ctx *s;
+
+  if (closed == ctx->lid_closed)
+    return;
+  ctx->lid_closed = closed;
+  if (closed)
+    xscreensaver_get_bool (ctx, DBUS_SD_SERVICE_NAME, DBUS_SD_OBJECT_PATH,
+                           DBUS_SD_INTERFACE, "Docked", &ctx->docked);
+  xlog (LOG_DEBUG, "lid %s%s", closed ? "closed" : "opened",
+        closed && ctx->docked ? " (docked)" : "");
+
+  /* Make up for anything we held back while it was shut. */
+  if (!closed)
+    LIST_FOREACH (s, &ctx->sessions, entries)
+      if (s->is_inhibited)
+        s->last_deactivate_time = xscreensaver_secs() - config->heartbeat_secs;
+}
+
+static void
+xscreensaver_watch_lid (struct handler_ctx *ctx)
+{
+  int present = 0;
+  int closed = 0;
+
+  if (xscreensaver_get_bool (ctx, DBUS_UPOWER_NAME, DBUS_UPOWER_OBJECT_PATH,
+                             DBUS_UPOWER_INTERFACE, "LidIsPresent",
+                             &present) >= 0)
+    ctx->lid_watched_p = 1;
+  if (!ctx->lid_watched_p || present)
+    xscreensaver_get_bool (ctx, DBUS_SD_SERVICE_NAME, DBUS_SD_OBJECT_PATH,
+                           DBUS_SD_INTERFACE, "LidClosed", &closed);
+  xscreensaver_lid_changed (ctx, closed);
+}
+
+/* PropertiesChanged from logind or UPower: picks LidClosed, LidIsClosed
+   and Docked out of the changed properties, and ignores the rest.
+ */
+static int
+xscreensaver_properties_handler (sd_bus_message *m, void *arg,
+                                 sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  const char *interface, *name;
+  int value;
+  int rc;
+
+  rc = sd_bus_message_read (m, "s", &interface);
+  if (rc >= 0)
+    rc = sd_bus_message_enter_container (m, 'a', "{sv}");
+  while (rc > 0 &&
+         (rc = sd_bus_message_enter_container (m, 'e', "sv")) > 0)
+    {
+      rc = sd_bus_message_read (m, "s", &name);
+      if (rc < 0)
+        break;
+      if (!strcmp (name, "LidClosed") || !strcmp (name, "LidIsClosed"))
+        {
+          rc = sd_bus_message_read (m, "v", "b", &value);
+          if (rc >= 0)
+            xscreensaver_lid_changed (ctx, value);
+        }
+      else if (!strcmp (name, "Docked"))
+        {
+          rc = sd_bus_message_read (m, "v", "b", &value);
+          if (rc >= 0)
+            ctx->docked = value;
+        }
+      else
+        rc = sd_bus_message_skip (m, "v");
+      if (rc >= 0)
+        rc = sd_bus_message_exit_container (m);
+    }
+  if (rc < 0)
+    xlog (LOG_WARNING, "dbus: PropertiesChanged read failed: %s",
+          strerror(-rc));
+  return 1;
+}
+
+/* True if nobody could see a heartbeat on this session's screen. */
+static int
+xscreensaver_display_hidden_p (struct handler_ctx *ctx,
+                               struct session_ctx *s)
+{
+  if (!ctx->lid_watched_p)
+    {
+      int closed = ctx->lid_closed;
+      xscreensaver_get_bool (ctx, DBUS_SD_SERVICE_NAME, DBUS_SD_OBJECT_PATH,
+                             DBUS_SD_INTERFACE, "LidClosed", &closed);
+      xscreensaver_lid_changed (ctx, closed);
+    }
+  if (ctx->lid_closed && !ctx->docked)
+    return 1;
+
+#ifdef HAVE_X11
+  if (s->dpy)
+    {
+      CARD16 power;
+      BOOL enabled;
+      if (DPMSCapable (s->dpy) && DPMSInfo (s->dpy, &power, &enabled) &&
+          enabled && power != DPMSModeOn)
+        return 1;
+    }
+#endif
+  return 0;
+}
+
+
+static uint32_t
+xscreensaver_get_cookie(void)
+{
+    uint32_t cookie = 0;
+    static int use_rand48 = 0;
+    int rc;
+
+    if (use_rand48)
+      {
+        cookie = lrand48();
+      }
+    else
+      {
+        /* According to the manpage may fail with ENOSYS on some kernels,
+           so just fall back to lrand48() if that (or any other failure)
+           happens. */
+        rc = getentropy(&cookie, sizeof cookie);
+        if (rc != 0)
+          {
+            xlog(LOG_WARNING,
+                 "getentropy() failed, falling back to lrand48(): %s",
+                 strerror(errno));
+            srand48(time(NULL));
+            use_rand48 = 1;
+            cookie = lrand48();
+          }
+      }
+    return cookie;
+}
+
+/* What the config has to say about a new inhibitor.  Returns the flags
+   it should have, less "idle" if an ignore rule matches, or -1 if it is
+   over inhibit_rate and should be refused.
+ */
+static int
+xscreensaver_inhibit_admit (struct handler_ctx *ctx, const char *application,
+                            const char *reason, uint32_t flags)
+{
+  int i;
+
+  if (config->inhibit_rate)
+    {
+      uint64_t now = xscreensaver_usec();
+      uint64_t cap = (uint64_t) config->inhibit_burst * 1000000;
+      ctx->inhibit_tokens += ((now - ctx->inhibit_tokens_at) *
+                              config->inhibit_rate);
+      ctx->inhibit_tokens_at = now;
+      if (ctx->inhibit_tokens > cap)
+        ctx->inhibit_tokens = cap;
+      if (ctx->inhibit_tokens < 1000000)
+        {
+          ctx->stats.inhibits_limited++;
+          return -1;
+        }
+      ctx->inhibit_tokens -= 1000000;
+    }
+
+  for (i = 0; i < config->nignores; i++)
+    if (!fnmatch (config->ignores[i].application, application, 0) &&
+        (!config->ignores[i].reason ||
+         !fnmatch (config->ignores[i].reason, reason, 0)))
+      {
+        if (flags & INHIBIT_IDLE)
+          ctx->stats.inhibits_ignored++;
+        return flags & ~INHIBIT_IDLE;
+      }
+  return flags;
+}
+
+/* Creates an inhibitor and files it everywhere it needs to be. */
+static struct inhibit_entry *
+xscreensaver_inhibit_add (struct handler_ctx *ctx,
+                          struct session_ctx *session,
+                          const char *application, const char *reason,
+                          const char *sender, uint32_t flags,
+                          uint64_t lease, int fd)
+{
+  struct inhibit_entry *entry = malloc (sizeof (*entry));
+
+  do
+    entry->cookie = xscreensaver_get_cookie();
+  while (inhibit_entry_find (ctx, entry->cookie));
+  entry->flags = flags;
+  entry->application = strdup (application);
+  entry->reason = strdup (reason);
+  entry->owner = strdup (sender ? sender : "");
+  entry->since = xscreensaver_time();
+  entry->session = session;
+  entry->lease_usec = lease;
+  entry->heap_index = -1;
+  if (lease)
+    {
+      entry->expires = xscreensaver_usec() + lease;
+      lease_heap_insert (ctx, entry);
+    }
+  entry->fd = fd;
+  if (fd >= 0)
+    {
+      LIST_INSERT_HEAD (&ctx->fd_inhibitors, entry, by_fd);
+      ctx->nfd_inhibitors++;
+    }
+  LIST_INSERT_HEAD (&session->inhibitors, entry, entries);
+  LIST_INSERT_HEAD (&ctx->by_cookie[INHIBIT_HASH(entry->cookie)],
+                    entry, by_cookie);
+  xscreensaver_inhibit_count (ctx, entry, 1);
+  TRACE4 (inhibit, entry->cookie, entry->application, entry->owner,
+          ctx->is_inhibited);
+  xscreensaver_record (RECORD_INHIBIT, flags, entry->cookie, application,
+                       reason);
+  return entry;
+}
+
+/* Drops the inhibitor with this cookie, if there is one.  Returns whether
+   there was.
+ */
+static int
+xscreensaver_inhibit_remove (struct handler_ctx *ctx, uint32_t cookie)
+{
+  struct inhibit_entry *entry = inhibit_entry_find (ctx, cookie);
+
+  ctx->stats.uninhibit_calls++;
+  if (entry)
+    inhibit_entry_drop (ctx, entry);
+  else
+    ctx->stats.uninhibit_unknown++;
+  TRACE3 (uninhibit, cookie, entry != NULL, ctx->is_inhibited);
+  xscreensaver_record (RECORD_UNINHIBIT, entry != NULL, cookie, NULL, NULL);
+  return entry != NULL;
+}
+
+static int
+xscreensaver_method_inhibit(sd_bus_message *m, void *arg,
+                            sd_bus_error *ret_error)
+{
+    struct handler_ctx *ctx = arg;
+    char *application_name, *inhibit_reason;
+    const char *sender;
+    struct session_ctx *session;
+    struct inhibit_entry *entry;
+    struct xlog_fields f;
+    uint64_t lease;
+    int flags;
+
+    int rc = sd_bus_message_read(m, "ss", &application_name, &inhibit_reason);
+    if (rc < 0) {
+        xlog(LOG_WARNING, "Failed to parse method call: %s", strerror(-rc));
+        return rc;
+    }
+    ctx->stats.inhibit_calls++;
+
+    flags = xscreensaver_inhibit_admit(ctx, application_name, inhibit_reason,
+                                       INHIBIT_IDLE);
+    if (flags < 0)
+      return sd_bus_error_set(ret_error, SD_BUS_ERROR_LIMITS_EXCEEDED,
+                              "Too many Inhibit calls");
+
+    sender = sd_bus_message_get_sender(m);
+    session = xscreensaver_session_for_message(ctx, m);
+    lease = lease_for_application(application_name);
+
+    entry = xscreensaver_inhibit_add(ctx, session, application_name,
+                                     inhibit_reason, sender, flags,
+                                     lease, -1);
+    f.mask = XLOG_COOKIE | XLOG_APP;
+    f.cookie = entry->cookie;
+    f.app = entry->application;
+    xlog_event(LOG_DEBUG, &f,
+        "Inhibit() called: Application: '%s': Reason: '%s' -> returning %u",
+        application_name,
+        inhibit_reason,
+        entry->cookie);
+
+    return sd_bus_reply_method_return(m, "u", entry->cookie);
+}
+
+static int
+xscreensaver_method_uninhibit(sd_bus_message *m, void *arg,
+                              sd_bus_error *ret_error)
+{
+    struct handler_ctx *ctx = arg;
+    uint32_t cookie;
+    struct xlog_fields f;
+    int found;
+
+    int rc = sd_bus_message_read(m, "u", &cookie);
+    if (rc < 0) {
+        xlog(LOG_WARNING, "Failed to parse method call: %s", strerror(-rc));
+        return rc;
+    }
+
+    found = xscreensaver_inhibit_remove(ctx, cookie);
+    f.mask = XLOG_COOKIE;
+    f.cookie = cookie;
+    xlog_event(LOG_DEBUG, &f, "UnInhibit() called: Cookie: %u%s",
+        cookie,
+        found ? ": Removed" : ": Not found, ignored");
+
+    return sd_bus_reply_method_return(m, "");
+}
+
+/* org.gnome.SessionManager and org.mate.SessionManager.  Inhibit takes
+   flags, and the toplevel window, which we do not need.
+ */
+static int
+xscreensaver_method_gsm_inhibit (sd_bus_message *m, void *arg,
+                                 sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  const char *application, *reason;
+  uint32_t xid, flags;
+  struct inhibit_entry *entry;
+  struct xlog_fields f;
+  int admitted;
+  int rc;
+
+  rc = sd_bus_message_read (m, "susu", &application, &xid, &reason, &flags);
+  if (rc < 0)
+    {
+      xlog (LOG_WARNING, "Failed to parse method call: %s", strerror(-rc));
+      return rc;
+    }
+  ctx->stats.inhibit_calls++;
+
+  admitted = xscreensaver_inhibit_admit (ctx, application, reason, flags);
+  if (admitted < 0)
+    return sd_bus_error_set (ret_error, SD_BUS_ERROR_LIMITS_EXCEEDED,
+                             "Too many Inhibit calls");
+  entry = xscreensaver_inhibit_add (ctx,
+                                    xscreensaver_session_for_message (ctx, m),
+                                    application, reason,
+                                    sd_bus_message_get_sender (m),
+                                    admitted, 0, -1);
+  f.mask = XLOG_COOKIE | XLOG_APP;
+  f.cookie = entry->cookie;
+  f.app = entry->application;
+  xlog_event (LOG_DEBUG, &f,
+              "SessionManager.Inhibit() called: Application: '%s': "
+              "Reason: '%s': Flags: %u -> returning %u",
+              application, reason, flags, entry->cookie);
+  return sd_bus_reply_method_return (m, "u", entry->cookie);
+}
+
+static int
+xscreensaver_method_gsm_uninhibit (sd_bus_message *m, void *arg,
+                                   sd_bus_error *ret_error)
+{
+  uint32_t cookie;
+  int rc = sd_bus_message_read (m, "u", &cookie);
+  if (rc < 0)
+    {
+      xlog (LOG_WARNING, "Failed to parse method call: %s", strerror(-rc));
+      return rc;
+    }
+  xlog (LOG_DEBUG, "SessionManager.Uninhibit() called: Cookie: %u%s", cookie,
+        xscreensaver_inhibit_remove (arg, cookie) ? "" : ": Not found");
+  return sd_bus_reply_method_return (m, "");
+}
+
+/* IsInhibited(u flags) -> b */
+static int
+xscreensaver_method_gsm_is_inhibited (sd_bus_message *m, void *arg,
+                                      sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  uint32_t flags;
+  int i, inhibited = 0;
+  int rc = sd_bus_message_read (m, "u", &flags);
+  if (rc < 0)
+    return rc;
+  for (i = 0; i < INHIBIT_NFLAGS; i++)
+    if ((flags & (1 << i)) && ctx->inhibit_flags[i])
+      inhibited = 1;
+  return sd_bus_reply_method_return (m, "b", inhibited);
+}
+
+static const sd_bus_vtable
+xscreensaver_gsm_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("Inhibit", "susu", "u", xscreensaver_method_gsm_inhibit,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("Uninhibit", "u", "", xscreensaver_method_gsm_uninhibit,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("IsInhibited", "u", "b",
+                  xscreensaver_method_gsm_is_inhibited,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_VTABLE_END
+};
+
+/* Hold logind's "block" sleep lock exactly while some inhibitor has the
+   suspend flag.  Called from the event loop once everything pending has
+   been dispatched.  Returns true if it took or released the lock, or
+   tried to.
+ */
+static int
+xscreensaver_block_update (struct handler_ctx *ctx)
+{
+  struct logind_lock *lock = &ctx->block_lock;
+  int want = (!ctx->standby_waiting_p &&
+              ctx->inhibit_flags[INHIBIT_SUSPEND_BIT] > 0);
+
+  if (want == (lock->message != NULL))
+    {
+      ctx->block_retry_at = ctx->block_retry_usec = 0;
+      return 0;
+    }
+  if (want)
+    {
+      /* Each try is a round trip to logind: don't spin on them. */
+      if (ctx->block_retry_at && xscreensaver_usec() < ctx->block_retry_at)
+        return 0;
+      if (xscreensaver_take_lock (ctx, lock) >= 0)
+        {
+          ctx->block_retry_at = ctx->block_retry_usec = 0;
+          xlog (LOG_INFO, "holding off suspend for %d inhibitors",
+                ctx->inhibit_flags[INHIBIT_SUSPEND_BIT]);
+        }
+      else
+        {
+          ctx->block_retry_usec = (!ctx->block_retry_usec ? BLOCK_RETRY_USEC
+                                   : ctx->block_retry_usec * 2);
+          if (ctx->block_retry_usec > BLOCK_RETRY_MAX_USEC)
+            ctx->block_retry_usec = BLOCK_RETRY_MAX_USEC;
+          ctx->block_retry_at = xscreensaver_usec() + ctx->block_retry_usec;
+        }
+    }
+  else
+    {
+      xscreensaver_release_lock (lock);
+      xlog (LOG_INFO, "no longer holding off suspend");
+    }
+  return 1;
+}
+
+/* Renew(u) -> b: extends the lease on an inhibitor.  Returns false if
+   the cookie is unknown, e.g. because the lease has already run out, in
+   which case the caller should call Inhibit again.  Inhibitors without a
+   lease are left alone, and count as renewed.
+ */
+static int
+xscreensaver_method_renew (sd_bus_message *m, void *arg,
+                           sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  struct inhibit_entry *entry;
+  uint32_t cookie;
+  int rc;
+
+  rc = sd_bus_message_read (m, "u", &cookie);
+  if (rc < 0)
+    {
+      xlog (LOG_WARNING, "Failed to parse method call: %s", strerror(-rc));
+      return rc;
+    }
+
+  entry = inhibit_entry_find (ctx, cookie);
+  if (entry && entry->lease_usec)
+    lease_renew (ctx, entry);
+  xscreensaver_record (RECORD_RENEW, entry != NULL, cookie, NULL, NULL);
+  xlog (LOG_DEBUG, "Renew() called: Cookie: %u%s", cookie,
+        entry ? "" : ": Not found");
+  return sd_bus_reply_method_return (m, "b", entry != NULL);
+}
+
+/* InhibitFd(ss) -> h: as Inhibit, but returns the write end of a pipe
+   instead of a cookie.  We keep the read end, and drop the inhibitor as
+   soon as poll() says that every copy of the write end has been closed.
+ */
+static int
+xscreensaver_method_inhibit_fd (sd_bus_message *m, void *arg,
+                                sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  const char *application, *reason;
+  struct inhibit_entry *entry;
+  struct xlog_fields f;
+  int fds[2];
+  int flags;
+  int rc;
+
+  rc = sd_bus_message_read (m, "ss", &application, &reason);
+  if (rc < 0)
+    {
+      xlog (LOG_WARNING, "Failed to parse method call: %s", strerror(-rc));
+      return rc;
+    }
+  ctx->stats.inhibit_calls++;
+
+  flags = xscreensaver_inhibit_admit (ctx, application, reason, INHIBIT_IDLE);
+  if (flags < 0)
+    return sd_bus_error_set (ret_error, SD_BUS_ERROR_LIMITS_EXCEEDED,
+                             "Too many Inhibit calls");
+  if (pipe2 (fds, O_CLOEXEC) < 0)
+    return -errno;
+  entry = xscreensaver_inhibit_add (ctx,
+                                    xscreensaver_session_for_message (ctx, m),
+                                    application, reason,
+                                    sd_bus_message_get_sender (m),
+                                    flags, 0, fds[0]);
+  f.mask = XLOG_COOKIE | XLOG_APP;
+  f.cookie = entry->cookie;
+  f.app = entry->application;
+  xlog_event (LOG_DEBUG, &f,
+              "InhibitFd() called: Application: '%s': Reason: '%s' -> %u",
+              application, reason, entry->cookie);
+
+  /* The message carries its own copy of the write end. */
+  rc = sd_bus_reply_method_return (m, "h", fds[1]);
+  close (fds[1]);
+  return rc;
+}
+
+/* Called when the client's end of an InhibitFd pipe has been closed. */
+static void
+xscreensaver_inhibit_hangup (struct handler_ctx *ctx,
+                             struct inhibit_entry *entry)
+{
+  struct xlog_fields f;
+  uint32_t cookie = entry->cookie;
+
+  f.mask = XLOG_COOKIE | XLOG_APP;
+  f.cookie = cookie;
+  f.app = entry->application;
+  xlog_event (LOG_DEBUG, &f, "inhibitor %u from '%s' closed its fd",
+              cookie, entry->application);
+  ctx->stats.fd_hangups++;
+  inhibit_entry_drop (ctx, entry);
+  xscreensaver_record (RECORD_HANGUP, 0, cookie, NULL, NULL);
+}
+
+static const sd_bus_vtable
+xscreensaver_inhibit_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("InhibitFd", "ss", "h", xscreensaver_method_inhibit_fd,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("Renew", "u", "b", xscreensaver_method_renew,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_VTABLE_END
+};
+
+#ifdef HAVE_X11
+
+/* The rest of org.freedesktop.ScreenSaver, answered from the state we
+   follow through X, for the caller's session.
+ */
+static int
+xscreensaver_method_get_active (sd_bus_message *m, void *arg,
+                                sd_bus_error *ret_error)
+{
+  struct session_ctx *s = xscreensaver_session_for_message (arg, m);
+  xscreensaver_x_process (s);
+  return sd_bus_reply_method_return (m, "b", s->saver_state != 0);
+}
+
+static int
+xscreensaver_method_get_active_time (sd_bus_message *m, void *arg,
+                                     sd_bus_error *ret_error)
+{
+  struct session_ctx *s = xscreensaver_session_for_message (arg, m);
+  uint32_t secs = 0;
+  xscreensaver_x_process (s);
+  if (s->saver_state)
+    secs = xscreensaver_time() - s->saver_since;
+  return sd_bus_reply_method_return (m, "u", secs);
+}
+
+static int
+xscreensaver_method_get_idle_time (sd_bus_message *m, void *arg,
+                                   sd_bus_error *ret_error)
+{
+  struct session_ctx *s = xscreensaver_session_for_message (arg, m);
+  long idle = xscreensaver_x_idle (s);
+  return sd_bus_reply_method_return (m, "u", (uint32_t) (idle > 0 ? idle : 0));
+}
+
+#endif /* HAVE_X11 */
+
+/*
+ * This vtable defines the service interface we implement.
+ */
+static const sd_bus_vtable
+xscreensaver_dbus_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("Inhibit", "ss", "u", xscreensaver_method_inhibit,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("UnInhibit", "u", "", xscreensaver_method_uninhibit,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+#ifdef HAVE_X11
+    SD_BUS_METHOD("GetActive", "", "b", xscreensaver_method_get_active,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("GetActiveTime", "", "u",
+                  xscreensaver_method_get_active_time,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("GetSessionIdleTime", "", "u",
+                  xscreensaver_method_get_idle_time,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+#endif
+    SD_BUS_VTABLE_END
+};
+
+
+static int
+xscreensaver_stats_append (sd_bus_message *reply, const char *name,
+                           uint64_t value)
+{
+  return sd_bus_message_append (reply, "{st}", name, value);
+}
+
+/* Returns every counter in struct xscreensaver_stats as a{st}.
+ */
+static int
+xscreensaver_method_get_stats (sd_bus_message *m, void *arg,
+                               sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  struct xscreensaver_stats *st = &ctx->stats;
+  sd_bus_message *reply = NULL;
+  char name[64];
+  int i;
+  int rc;
+
+  rc = sd_bus_message_new_method_return (m, &reply);
+  if (rc < 0) goto DONE;
+  rc = sd_bus_message_open_container (reply, 'a', "{st}");
+  if (rc < 0) goto DONE;
+
+  rc = xscreensaver_stats_append (reply, "inhibit_calls", st->inhibit_calls);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "uninhibit_calls",
+                                    st->uninhibit_calls);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "uninhibit_unknown",
+                                    st->uninhibit_unknown);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "fd_hangups", st->fd_hangups);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "leases",
+                                    (uint64_t) ctx->nleases);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "lease_renewals",
+                                    st->lease_renewals);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "leases_expired",
+                                    st->leases_expired);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "inhibitors",
+                                    (uint64_t) ctx->ninhibitors);
+  for (i = 0; rc >= 0 && i < INHIBIT_NFLAGS; i++)
+    {
+      sprintf (name, "inhibitors_%s", inhibit_flag_names[i]);
+      rc = xscreensaver_stats_append (reply, name,
+                                      (uint64_t) ctx->inhibit_flags[i]);
+    }
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "sessions",
+                                    (uint64_t) ctx->nsessions);
+  for (i = 0; rc >= 0 && i < XSS_NVERBS; i++)
+    {
+      sprintf (name, "commands_%s", xscreensaver_verbs[i]);
+      rc = xscreensaver_stats_append (reply, name, st->commands[i]);
+    }
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "commands_failed",
+                                    st->commands_failed);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "heartbeats", st->heartbeats);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "heartbeats_skipped",
+                                    st->heartbeats_skipped);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "heartbeats_hidden",
+                                    st->heartbeats_hidden);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "commands_skipped",
+                                    st->commands_skipped);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "wakeups_system_bus",
+                                    st->wakeups[WAKE_SYSTEM_BUS]);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "wakeups_user_bus",
+                                    st->wakeups[WAKE_USER_BUS]);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "wakeups_timeout",
+                                    st->wakeups[WAKE_TIMEOUT]);
+  for (i = 0; rc >= 0 && i < TRIGGER_NTRIGGERS; i++)
+    {
+      sprintf (name, "%s_count", trigger_names[i]);
+      rc = xscreensaver_stats_append (reply, name, st->triggers[i]);
+      if (rc < 0) break;
+      sprintf (name, "%s_usec_total", trigger_names[i]);
+      rc = xscreensaver_stats_append (reply, name, st->trigger_usec[i]);
+      if (rc < 0) break;
+      sprintf (name, "%s_usec_max", trigger_names[i]);
+      rc = xscreensaver_stats_append (reply, name, st->trigger_usec_max[i]);
+    }
+  for (i = 0; rc >= 0 && i < SLEEP_NSTATES; i++)
+    {
+      uint64_t usec = st->sleep_state_usec[i];
+      if (i == (int) ctx->sleep_state)
+        usec += xscreensaver_usec() - ctx->sleep_state_since;
+      sprintf (name, "sleep_%s_count", sleep_state_names[i]);
+      rc = xscreensaver_stats_append (reply, name, st->sleep_state_count[i]);
+      if (rc < 0) break;
+      sprintf (name, "sleep_%s_usec", sleep_state_names[i]);
+      rc = xscreensaver_stats_append (reply, name, usec);
+    }
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "sleep_acquire_failed",
+                                    st->sleep_acquire_failed);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "sleep_out_of_order",
+                                    st->sleep_out_of_order);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "logind_restarts",
+                                    st->logind_restarts);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "idle_hints", st->idle_hints);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "standby",
+                                    (uint64_t) ctx->standby_waiting_p);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "standby_takeovers",
+                                    st->standby_takeovers);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "resume_ready", st->resume_ready);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "resume_ready_usec_total",
+                                    st->resume_ready_usec);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "resume_ready_usec_max",
+                                    st->resume_ready_usec_max);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "resume_retries",
+                                    st->resume_retries);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "resume_gave_up",
+                                    st->resume_gave_up);
+  for (i = 0; rc >= 0 && i < BUS_NBUSES; i++)
+    {
+      sprintf (name, "%s_bus_messages", bus_names[i]);
+      rc = xscreensaver_stats_append (reply, name, st->bus_messages[i]);
+      if (rc < 0) break;
+      sprintf (name, "%s_bus_bytes", bus_names[i]);
+      rc = xscreensaver_stats_append (reply, name, st->bus_bytes[i]);
+    }
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "inhibits_limited",
+                                    st->inhibits_limited);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "inhibits_ignored",
+                                    st->inhibits_ignored);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "config_loads",
+                                    st->config_loads);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "config_errors",
+                                    st->config_errors);
+  for (i = 0; rc >= 0 && i < BACKEND_NBACKENDS; i++)
+    {
+      sprintf (name, "backend_%s_usec", backend_names[i]);
+      rc = xscreensaver_stats_append (reply, name, st->backend_usec[i]);
+      if (rc < 0) break;
+      sprintf (name, "backend_%s_commands", backend_names[i]);
+      rc = xscreensaver_stats_append (reply, name, st->backend_commands[i]);
+      if (rc < 0) break;
+      sprintf (name, "backend_%s_fallbacks", backend_names[i]);
+      rc = xscreensaver_stats_append (reply, name, st->backend_fallbacks[i]);
+    }
+  for (i = 0; rc >= 0 && i < SOURCE_NSOURCES; i++)
+    {
+      sprintf (name, "loop_%s_nsec_total", source_names[i]);
+      rc = xscreensaver_stats_append (reply, name, st->source_nsec[i]);
+      if (rc < 0) break;
+      sprintf (name, "loop_%s_nsec_max", source_names[i]);
+      rc = xscreensaver_stats_append (reply, name, st->source_nsec_max[i]);
+      if (rc < 0) break;
+      sprintf (name, "loop_%s_callbacks", source_names[i]);
+      rc = xscreensaver_stats_append (reply, name, st->source_callbacks[i]);
+    }
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "loop_poll_nsec_total",
+                                    st->poll_nsec);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "loop_wakeups", st->loop_wakeups);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "loop_callbacks_max",
+                                    st->loop_callbacks_max);
+  if (rc >= 0)
+    rc = xscreensaver_stats_append (reply, "loop_slow_callbacks",
+                                    st->slow_callbacks);
+  if (rc < 0) goto DONE;
+
+  rc = sd_bus_message_close_container (reply);
+  if (rc < 0) goto DONE;
+  rc = sd_bus_send (NULL, reply, NULL);
+
+ DONE:
+  if (rc < 0)
+    xlog (LOG_WARNING, "dbus: GetStats reply failed: %s", strerror(-rc));
+  if (reply)
+    sd_bus_message_unref (reply);
+  return rc;
+}
+
+/* Returns the live inhibitors as a(ussst):
+   cookie, application, reason, owner, age in seconds.
+ */
+static int
+xscreensaver_method_list_inhibitors (sd_bus_message *m, void *arg,
+                                     sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  sd_bus_message *reply = NULL;
+  struct session_ctx *s;
+  struct inhibit_entry *entry;
+  time_t now = xscreensaver_time();
+  int rc;
+
+  rc = sd_bus_message_new_method_return (m, &reply);
+  if (rc < 0) goto DONE;
+  rc = sd_bus_message_open_container (reply, 'a', "(ussst)");
+  if (rc < 0) goto DONE;
+
+  LIST_FOREACH(s, &ctx->sessions, entries)
+    LIST_FOREACH(entry, &s->inhibitors, entries)
+      {
+        rc = sd_bus_message_append (reply, "(ussst)",
+                                    entry->cookie,
+                                    entry->application,
+                                    entry->reason,
+                                    entry->owner,
+                                    (uint64_t) (now - entry->since));
+        if (rc < 0) goto DONE;
+      }
+
+  rc = sd_bus_message_close_container (reply);
+  if (rc < 0) goto DONE;
+  rc = sd_bus_send (NULL, reply, NULL);
+
+ DONE:
+  if (rc < 0)
+    xlog (LOG_WARNING, "dbus: ListInhibitors reply failed: %s",
+          strerror(-rc));
+  if (reply)
+    sd_bus_message_unref (reply);
+  return rc;
+}
+
+/* Returns the slow callback ring as a(tsst), oldest first: wall clock
+   time, source, bus member or session, and nanoseconds.
+ */
+static int
+xscreensaver_method_list_slow_callbacks (sd_bus_message *m, void *arg,
+                                         sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  sd_bus_message *reply = NULL;
+  unsigned long i;
+  int rc;
+
+  rc = sd_bus_message_new_method_return (m, &reply);
+  if (rc < 0) goto DONE;
+  rc = sd_bus_message_open_container (reply, 'a', "(tsst)");
+  if (rc < 0) goto DONE;
+
+  i = ctx->nslow > SLOW_RING_SIZE ? ctx->nslow - SLOW_RING_SIZE : 0;
+  for (; i < ctx->nslow; i++)
+    {
+      struct slow_callback *slow = &ctx->slow_ring[i % SLOW_RING_SIZE];
+      rc = sd_bus_message_append (reply, "(tsst)",
+                                  (uint64_t) slow->when,
+                                  source_names[slow->source],
+                                  slow->name,
+                                  slow->nsec);
+      if (rc < 0) goto DONE;
+    }
+
+  rc = sd_bus_message_close_container (reply);
+  if (rc < 0) goto DONE;
+  rc = sd_bus_send (NULL, reply, NULL);
+
+ DONE:
+  if (rc < 0)
+    xlog (LOG_WARNING, "dbus: ListSlowCallbacks reply failed: %s",
+          strerror(-rc));
+  if (reply)
+    sd_bus_message_unref (reply);
+  return rc;
+}
+
+/* Measures the command backends again, and returns what they cost as
+   a{st}, cheapest first: the order they will be tried in.
+ */
+static int
+xscreensaver_method_calibrate (sd_bus_message *m, void *arg,
+                               sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  sd_bus_message *reply = NULL;
+  int i;
+  int rc;
+
+  xscreensaver_calibrate (ctx);
+
+  rc = sd_bus_message_new_method_return (m, &reply);
+  if (rc < 0) goto DONE;
+  rc = sd_bus_message_open_container (reply, 'a', "{st}");
+  for (i = 0; rc >= 0 && i < ctx->nbackends; i++)
+    rc = xscreensaver_stats_append (reply,
+                                    calibrate_names[ctx->backends[i]],
+                                    ctx->stats.backend_usec[ctx->backends[i]]);
+  if (rc < 0) goto DONE;
+  rc = sd_bus_message_close_container (reply);
+  if (rc < 0) goto DONE;
+  rc = sd_bus_send (NULL, reply, NULL);
+
+ DONE:
+  if (rc < 0)
+    xlog (LOG_WARNING, "dbus: Calibrate reply failed: %s", strerror(-rc));
+  if (reply)
+    sd_bus_message_unref (reply);
+  return rc;
+}
+
+static const sd_bus_vtable
+xscreensaver_stats_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("GetStats", "", "a{st}", xscreensaver_method_get_stats,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("ListInhibitors", "", "a(ussst)",
+                  xscreensaver_method_list_inhibitors,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("Calibrate", "", "a{st}", xscreensaver_method_calibrate,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("ListSlowCallbacks", "", "a(tsst)",
+                  xscreensaver_method_list_slow_callbacks,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_VTABLE_END
+};
+
+
+/* Notes what is being dispatched, for the profiler to blame. */
+static void
+xscreensaver_dispatch_name (struct handler_ctx *ctx, sd_bus_message *m)
+{
+  const char *member = sd_bus_message_get_member (m);
+  snprintf (ctx->dispatch_name, sizeof(ctx->dispatch_name), "%s",
+            member ? member : "(reply)");
+}
+
+/* Installed as a filter on each bus: sees every incoming message before
+   it is dispatched, so it is where we count them.
+ */
+static int
+xscreensaver_count_system_message (sd_bus_message *m, void *arg,
+                                   sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  ctx->stats.bus_messages[BUS_SYSTEM]++;
+  xscreensaver_dispatch_name (ctx, m);
+  return 0;  /* 0 means keep dispatching */
+}
+
+static int
+xscreensaver_count_user_message (sd_bus_message *m, void *arg,
+                                 sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+  ctx->stats.bus_messages[BUS_USER]++;
+  ctx->last_active = xscreensaver_secs();
+  xscreensaver_dispatch_name (ctx, m);
+  return 0;
+}
+
+/* Called after poll() reports the bus fd readable: adds the number of
+   bytes waiting on the socket, which sd_bus_process() is about to consume.
+ */
+static void
+xscreensaver_count_bytes (struct handler_ctx *ctx, enum bus_id bus,
+                          struct pollfd *fd)
+{
+  int avail = 0;
+  if (!(fd->revents & POLLIN))
+    return;
+  if (ioctl (fd->fd, FIONREAD, &avail) == 0 && avail > 0)
+    ctx->stats.bus_bytes[bus] += avail;
+}
+
+
+/* The event loop profiler.  Charges the time since 'start' to 'source',
+   and returns the time now, to start the next measurement from.  If
+   'callback_p', that time was a callback doing real work, and counts
+   as one; otherwise it was the cost of finding out there was none.
+   Either way, one that ran past config->slow_callback_ms is logged and
+   goes in the ring, under 'name' or the bus member being dispatched.
+ */
+static uint64_t
+xscreensaver_profile (struct handler_ctx *ctx, enum loop_source source,
+                      const char *name, int callback_p, uint64_t start)
+{
+  struct xscreensaver_stats *st = &ctx->stats;
+  uint64_t now = xscreensaver_nsec();
+  uint64_t nsec = now - start;
+
+  st->source_nsec[source] += nsec;
+  if (nsec > st->source_nsec_max[source])
+    st->source_nsec_max[source] = nsec;
+  if (callback_p)
+    {
+      st->source_callbacks[source]++;
+      ctx->wakeup_callbacks++;
+    }
+
+  if (config->slow_callback_ms &&
+      nsec >= config->slow_callback_ms * (uint64_t) 1000000)
+    {
+      struct slow_callback *slow =
+        &ctx->slow_ring[ctx->nslow++ % SLOW_RING_SIZE];
+      if (!name)
+        name = ctx->dispatch_name;
+      slow->when = xscreensaver_time();
+      slow->source = source;
+      slow->nsec = nsec;
+      snprintf (slow->name, sizeof(slow->name), "%s", name);
+      st->slow_callbacks++;
+      xlog (LOG_WARNING, "slow callback: %s%s%s took %lu ms",
+            source_names[source], *name ? " " : "", name,
+            (unsigned long) (nsec / 1000000));
+    }
+  return now;
+}
+
+/* Our own timers: leases running out, heartbeats, the -inhibit-only
+   idle exit and asking for the sleep or block lock again.  Returns how many
+   milliseconds until the first of them is due, or 'limit' if sooner.
+ */
+static uint64_t
+xscreensaver_timers_next (struct handler_ctx *ctx, uint64_t limit)
+{
+  struct session_ctx *s;
+  uint64_t now_usec = xscreensaver_usec();
+  time_t now = xscreensaver_secs();
+  uint64_t wait;
+
+  if (ctx->nleases)
+    {
+      uint64_t next = ctx->leases[0]->expires;
+      wait = next > now_usec ? (next - now_usec + 999) / 1000 : 0;
+      if (wait < limit)
+        limit = wait;
+    }
+
+  /* While the lid is shut there are no heartbeats, unless we have to
+     keep asking whether it has opened again. */
+  if (ctx->is_inhibited && !ctx->standby_waiting_p &&
+      !(config->hold_hidden_p &&
+        ctx->lid_watched_p && ctx->lid_closed && !ctx->docked))
+    LIST_FOREACH (s, &ctx->sessions, entries)
+      if (s->is_inhibited)
+        {
+          time_t due = s->last_deactivate_time + config->heartbeat_secs;
+          wait = due > now ? (due - now) * 1000 : 0;
+          if (wait < limit)
+            limit = wait;
+        }
+
+  if (inhibit_only_p && !ctx->ninhibitors)
+    {
+      time_t due = ctx->last_active + IDLE_EXIT_SECS;
+      wait = due > now ? (due - now) * 1000 : 0;
+      if (wait < limit)
+        limit = wait;
+    }
+
+  if (ctx->sleep_retry_at && ctx->sleep_state == SLEEP_IDLE)
+    {
+      wait = (ctx->sleep_retry_at > now_usec
+              ? (ctx->sleep_retry_at - now_usec + 999) / 1000
+              : 0);
+      if (wait < limit)
+        limit = wait;
+    }
+
+  /* xscreensaver_block_update() runs on every pass: just wake up. */
+  if (ctx->block_retry_at)
+    {
+      wait = (ctx->block_retry_at > now_usec
+              ? (ctx->block_retry_at - now_usec + 999) / 1000
+              : 0);
+      if (wait < limit)
+        limit = wait;
+    }
+
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    if (s->resume_start)
+      {
+        wait = (xscreensaver_resume_due_p (s, now_usec) ? 0
+                : (s->resume_retry_at - now_usec + 999) / 1000);
+        if (wait < limit)
+          limit = wait;
+      }
+
+  return limit;
+}
+
+/* Runs whichever of those are due, except the idle exit, which is up to
+   the caller.
+ */
+static void
+xscreensaver_timers_run (struct handler_ctx *ctx)
+{
+  struct session_ctx *s;
+  time_t now;
+
+  if (ctx->nleases)
+    lease_expire (ctx, xscreensaver_usec());
+
+  if (ctx->sleep_retry_at && ctx->sleep_state == SLEEP_IDLE &&
+      xscreensaver_usec() >= ctx->sleep_retry_at)
+    xscreensaver_sleep_acquire (ctx);
+
+  LIST_FOREACH (s, &ctx->sessions, entries)
+    if (xscreensaver_resume_due_p (s, xscreensaver_usec()))
+      {
+        xscreensaver_resume_run (ctx);
+        break;
+      }
+
+  if (ctx->is_inhibited && !ctx->standby_waiting_p)
+    {
+      int due = 0;
+      now = xscreensaver_secs();
+      LIST_FOREACH (s, &ctx->sessions, entries)
+        {
+          long idle;
+          s->run_p = (s->is_inhibited &&
+                      now - s->last_deactivate_time >= config->heartbeat_secs);
+          if (s->run_p && (idle = xscreensaver_x_idle (s)) >= 0 &&
+              idle < config->heartbeat_secs)
+            {
+              /* The user did something 'idle' seconds ago, which
+                 reset xscreensaver's timer just as a heartbeat would
+                 have.  Count from then instead. */
+              s->last_deactivate_time = now - idle;
+              ctx->stats.heartbeats_skipped++;
+              s->run_p = 0;
+            }
+          if (s->run_p && config->hold_hidden_p &&
+              xscreensaver_display_hidden_p (ctx, s))
+            {
+              /* Nobody would see it.  Look again next time, or as soon
+                 as the lid opens. */
+              xlog(LOG_DEBUG, "session \"%s\": display hidden, "
+                   "holding heartbeat", s->id);
+              s->last_deactivate_time = now;
+              ctx->stats.heartbeats_hidden++;
+              s->run_p = 0;
+            }
+          if (s->run_p)
+            {
+              xlog(LOG_DEBUG, "session \"%s\": %d active inhibitors, "
+                   "deactivating screensaver", s->id, s->is_inhibited);
+              ctx->stats.heartbeats++;
+              s->last_deactivate_time = now;
+              due++;
+            }
+        }
+      if (due)
+        xscreensaver_command_selected (ctx, XSS_DEACTIVATE);
+    }
+}
+
+
+/* The session managers' names are only ours if nobody else has them:
+   under GNOME or MATE, the real one does.  Asked for again on taking
+   over from another copy, which may have had them.
+ */
+static void
+xscreensaver_user_bus_gsm_names (sd_bus *user_bus)
+{
+  if (!session_manager_p)
+    return;
+  if (sd_bus_request_name (user_bus, DBUS_GSM_NAME, 0) < 0)
+    xlog (LOG_INFO, "%s is taken, not serving it", DBUS_GSM_NAME);
+  if (sd_bus_request_name (user_bus, DBUS_MSM_NAME, 0) < 0)
+    xlog (LOG_INFO, "%s is taken, not serving it", DBUS_MSM_NAME);
+}
+
+/* Called when the bus gives us DBUS_FDO_NAME: with -standby, that means
+   the copy ahead of us in the queue has gone, and we are now it.
+   Everything else was set up at startup.  DBUS_CLIENT_NAME follows in
+   its own NameAcquired, which we need not wait for.
+ */
+static int
+xscreensaver_standby_handler (sd_bus_message *m, void *arg,
+                              sd_bus_error *ret_error)
+{
+  struct handler_ctx *ctx = arg;
+
+  if (!ctx->standby_waiting_p)
+    return 1;  /* The first time, when it was already ours */
+  ctx->standby_waiting_p = 0;
+  ctx->stats.standby_takeovers++;
+  xlog (LOG_NOTICE, "the other copy has gone: taking over %s",
+        DBUS_FDO_NAME);
+  xscreensaver_user_bus_gsm_names (sd_bus_message_get_bus (m));
+  return 1;
+}
+
+/* Asks for the names that clients call us by.  Also used to take them
+   back if a call slipped in while we were letting go of them.  With
+   'queue_p', returns 1 if we are queued behind another copy for them.
+ */
+static int
+xscreensaver_user_bus_names (sd_bus *user_bus, int queue_p)
+{
+  uint64_t flags = queue_p ? SD_BUS_NAME_QUEUE : 0;
+  int rc, queued;
+
+  rc = sd_bus_request_name(user_bus, DBUS_FDO_NAME, flags);
+  if (rc < 0)
+    {
+      warnx ("dbus: failed to connect as %s: %s",
+             DBUS_FDO_NAME, strerror(-rc));
+      return -1;
+    }
+  queued = (rc == 0);
+
+  rc = sd_bus_request_name (user_bus, DBUS_CLIENT_NAME, flags);
+  if (rc < 0)
+    {
+      warnx ("dbus: failed to connect as %s: %s",
+             DBUS_CLIENT_NAME, strerror(-rc));
+      return -1;
+    }
+
+  /* Waiting in line, we must not look like the active copy anywhere. */
+  if (!queued)
+    xscreensaver_user_bus_gsm_names (user_bus);
+  return queued;
+}
+
+/* Gives up every name that xscreensaver_user_bus_names() asked for.
+   Those we never got are not an error. */
+static void
+xscreensaver_user_bus_release (sd_bus *user_bus)
+{
+  sd_bus_release_name (user_bus, DBUS_FDO_NAME);
+  sd_bus_release_name (user_bus, DBUS_CLIENT_NAME);
+  if (session_manager_p)
+    {
+      sd_bus_release_name (user_bus, DBUS_GSM_NAME);
+      sd_bus_release_name (user_bus, DBUS_MSM_NAME);
+    }
+}
+
+/* For -inhibit-only: gives up our names, so that the next call to any of
+   them starts a new copy, then answers whatever was already on its way
+   to us.  Returns true if that left us with nothing to do and we can go.
+ */
+static int
+xscreensaver_user_bus_retire (struct handler_ctx *ctx, sd_bus *user_bus)
+{
+  int rc;
+
+  /* Whatever is already here, while the names are still ours. */
+  do
+    rc = sd_bus_process (user_bus, NULL);
+  while (rc > 0);
+  if (ctx->ninhibitors)
+    return 0;
+
+  xlog (LOG_INFO, "idle for %d seconds with no inhibitors, exiting",
+        IDLE_EXIT_SECS);
+  xscreensaver_user_bus_release (user_bus);
+
+  do
+    rc = sd_bus_process (user_bus, NULL);
+  while (rc > 0);
+
+  if (ctx->ninhibitors == 0)
+    return 1;
+
+  /* Someone got in under the wire.  Their UnInhibit will come to the
+     well-known name, so it had better still be us.  But a call that came
+     after we let go may already be starting a new copy: queue for the
+     names rather than race it, and leave the bus to say who was first. */
+  if (xscreensaver_user_bus_names (user_bus, 1) == 0)
+    {
+      xlog (LOG_INFO, "inhibited while exiting, staying");
+      return 0;
+    }
+
+  /* The new copy won, and the UnInhibits will go to it.  Hang on to
+     these and they would never go away. */
+  xlog (LOG_WARNING, "another copy has our names: dropping %d inhibitors",
+        ctx->ninhibitors);
+  xscreensaver_user_bus_release (user_bus);
+  return 1;
+}
+
+/* Lets go of everything we hold, on the way out: our names, so that the
+   next copy can have them at once; every inhibitor; the logind locks;
+   and everything allocated for them, so that whatever is left over at
+   exit is a real leak.  The buses themselves are the caller's.
+ */
+static void
+xscreensaver_shutdown (struct handler_ctx *ctx, sd_bus *user_bus)
+{
+  struct session_ctx *s;
+  int i;
+
+  if (user_bus)
+    xscreensaver_user_bus_release (user_bus);
+  if (ctx->ninhibitors)
+    xlog (LOG_INFO, "dropping %d inhibitors", ctx->ninhibitors);
+  xscreensaver_idle_hint_clear (ctx);
+  while ((s = LIST_FIRST (&ctx->sessions)))
+    xscreensaver_session_remove (ctx, s);
+  xscreensaver_release_lock (&ctx->sleep_lock);
+  xscreensaver_release_lock (&ctx->shutdown_lock);
+  xscreensaver_release_lock (&ctx->block_lock);
+  free (ctx->leases);
+  ctx->leases = NULL;
+  ctx->leases_size = 0;
+  if (ctx->helper_fd >= 0)
+    {
+      close (ctx->helper_fd);
+      ctx->helper_fd = -1;
+    }
+  config_free ((struct config *) config);
+  config = &default_config;
+  for (i = 0; i < ctx->nlogind_matches; i++)
+    ctx->logind_matches[i].slot =
+      sd_bus_slot_unref (ctx->logind_matches[i].slot);
+  ctx->nlogind_matches = 0;
+  free (ctx->logind_owner);
+  ctx->logind_owner = NULL;
+}
+
+
+/* Connects to the session bus and starts serving org.freedesktop.ScreenSaver,
+   our own interfaces and, if they are free, the session managers' names.
+ */
+static int
+xscreensaver_user_bus_open (struct handler_ctx *ctx, sd_bus **user_busp)
+{
+  sd_bus *user_bus;
+  int rc;
+
+  rc = sd_bus_open_user (user_busp);
+  if (rc < 0) {
+    warnx ("dbus: connection failed: %s", strerror(-rc));
+    return -1;
+  }
+  user_bus = *user_busp;
+
+  rc = sd_bus_add_object_vtable(user_bus,
+                                NULL,
+                                DBUS_FDO_OBJECT_PATH,
+                                DBUS_FDO_INTERFACE,
+                                xscreensaver_dbus_vtable,
+                                ctx);
+  if (rc < 0) {
+    warnx("dbus: vtable registration failed: %s", strerror(-rc));
+    return -1;
+  }
 
   rc = sd_bus_add_object_vtable(user_bus,
                                 NULL,
                                 DBUS_FDO_OBJECT_PATH_2,
                                 DBUS_FDO_INTERFACE,
                                 xscreensaver_dbus_vtable,
-                                &global_ctx);
+                                ctx);
   if (rc < 0) {
     warnx("dbus: vtable registration failed: %s", strerror(-rc));
-    goto FAIL;
+    return -1;
+  }
+
+  rc = sd_bus_add_object_vtable(user_bus,
+                                NULL,
+                                DBUS_CLIENT_OBJECT_PATH,
+                                DBUS_CLIENT_STATS_INTERFACE,
+                                xscreensaver_stats_vtable,
+                                ctx);
+  if (rc < 0) {
+    warnx("dbus: vtable registration failed: %s", strerror(-rc));
+    return -1;
+  }
+
+  rc = sd_bus_add_object_vtable(user_bus,
+                                NULL,
+                                DBUS_CLIENT_OBJECT_PATH,
+                                DBUS_CLIENT_INHIBIT_INTERFACE,
+                                xscreensaver_inhibit_vtable,
+                                ctx);
+  if (rc < 0) {
+    warnx("dbus: vtable registration failed: %s", strerror(-rc));
+    return -1;
+  }
+
+  rc = sd_bus_add_filter (user_bus, NULL, xscreensaver_count_user_message,
+                          ctx);
+  if (rc < 0) {
+    warnx("dbus: add filter failed: %s", strerror(-rc));
+    return -1;
   }
 
-  rc = sd_bus_request_name(user_bus, DBUS_FDO_NAME, 0);
+  /* Under GNOME or MATE, the session manager already has these names,
+     and that is fine. */
+  if (session_manager_p)
+    {
+      rc = sd_bus_add_object_vtable (user_bus, NULL, DBUS_GSM_OBJECT_PATH,
+                                     DBUS_GSM_INTERFACE,
+                                     xscreensaver_gsm_vtable, ctx);
+      if (rc >= 0)
+        rc = sd_bus_add_object_vtable (user_bus, NULL, DBUS_MSM_OBJECT_PATH,
+                                       DBUS_MSM_INTERFACE,
+                                       xscreensaver_gsm_vtable, ctx);
+    }
+  if (rc < 0)
+    {
+      warnx ("dbus: vtable registration failed: %s", strerror(-rc));
+      return -1;
+    }
+
+  /* Before asking, so that the handover cannot come before the match. */
+  if (standby_p)
+    {
+      rc = sd_bus_add_match (user_bus, NULL, DBUS_STANDBY_MATCH,
+                             xscreensaver_standby_handler, ctx);
+      if (rc < 0)
+        {
+          warnx ("dbus: add match failed: %s", strerror(-rc));
+          return -1;
+        }
+    }
+
+  rc = xscreensaver_user_bus_names (user_bus, standby_p);
+  if (rc < 0)
+    return -1;
+  ctx->standby_waiting_p = rc;
+  if (rc)
+    xlog (LOG_NOTICE, "%s is taken: standing by", DBUS_FDO_NAME);
+  return 0;
+}
+
+
+static int
+xscreensaver_systemd_loop (void)
+{
+  sd_bus *system_bus = NULL, *user_bus = NULL;
+  struct handler_ctx *ctx = &global_ctx;
+#ifdef HAVE_X11
+  struct session_ctx *s;
+#endif
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  struct pollfd *fds = NULL;
+  int fds_size = 0;
+  int config_fd = -1, signal_fd = -1;
+  sigset_t mask;
+  uint64_t t, t0;               /* For xscreensaver_profile() */
+  int rc, status = EXIT_FAILURE;
+
+  if (spawn_helper_p)
+    xscreensaver_helper_start (ctx);
+
+  /* Children are waited for with sigtimedwait() when there is a deadline,
+     and SIGTERM and SIGINT are read from a signalfd, so that we shut down
+     from the top of the loop and not from inside some handler.  The
+     helper has already been forked, and does its own thing. */
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGTERM);
+  sigaddset (&mask, SIGINT);
+  sigprocmask (SIG_BLOCK, &mask, NULL);
+  signal_fd = signalfd (-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (signal_fd < 0)
+    xlog (LOG_WARNING, "signalfd: %s", strerror(errno));
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGCHLD);
+  sigprocmask (SIG_BLOCK, &mask, NULL);
+
+  if (config_load () < 0)
+    ctx->stats.config_errors++;
+  else
+    ctx->stats.config_loads++;
+  config_fd = config_watch ();
+
+  /* Started by the bus, we have whatever environment the session gave
+     it, which may be none: then there is no display to keep awake, and
+     inhibitors would be taken and do nothing.  Better to fail the call.
+     Without XDG_SESSION_ID we still work, but we ask logind which
+     session our pid is in, which for us may be none.
+   */
+  if (inhibit_only_p && !ctx->all_sessions_p &&
+      !(getenv ("DISPLAY") && *getenv ("DISPLAY")))
+    {
+      warnx ("-inhibit-only: DISPLAY is not set.  The session should run "
+             "\"dbus-update-activation-environment DISPLAY XDG_SESSION_ID\"");
+      goto FAIL;
+    }
+
+  /* The session we were started in.  With -all-sessions, any others are
+     found once we are on the system bus.
+   */
+  xscreensaver_session_add (ctx, getenv ("XDG_SESSION_ID"),
+                            getenv ("DISPLAY"), NULL);
+
+  /* 'user_bus' is where we receive messages from other programs sending
+     inhibit/uninhibit to org.freedesktop.ScreenSaver, etc.  The core
+     started with -no-inhibit has none: that is the -inhibit-only
+     process's job, which the bus starts when it is first needed.
+   */
+  if (!no_inhibit_p &&
+      xscreensaver_user_bus_open (ctx, &user_bus) < 0)
+    goto FAIL;
+
+
+  /* 'system_bus' is where we hold a lock on org.freedesktop.login1, meaning
+     that the system will send us a PrepareForSleep message when the system is
+     about to suspend.
+   */
+
+  rc = (private_bus_p
+        ? sd_bus_open_user (&system_bus)
+        : sd_bus_open_system (&system_bus));
+  if (rc < 0)
+    {
+      warnx ("dbus: open failed: %s", strerror(-rc));
+      goto FAIL;
+    }
+
+  rc = sd_bus_add_filter (system_bus, NULL, xscreensaver_count_system_message,
+                          &global_ctx);
+  if (rc < 0)
+    {
+      warnx ("dbus: add filter failed: %s", strerror(-rc));
+      goto FAIL;
+    }
+
+  ctx->system_bus = system_bus;
+  ctx->sleep_state_since = xscreensaver_usec();
+  if (xscreensaver_logind_start (ctx) < 0)
+    goto FAIL;
+
+  /* With -inhibit-only, the system bus is only for the "block" lock,
+     the lid and the sessions: sleep, shutdown and Lock belong to the
+     resident core. */
+  if (!inhibit_only_p)
+    {
+      /* Obtain a lock fd from the "Inhibit" method, so that we can delay
+         sleep when a "PrepareForSleep" signal is posted. */
+      xscreensaver_sleep_acquire (ctx);
+
+      /* Same again for shutdown.  Not fatal: we can live without it. */
+      xscreensaver_take_lock (ctx, &ctx->shutdown_lock);
+
+
+      /* This is basically an event mask, saying that we are interested in
+         "PrepareForSleep", and to run our callback when that signal is
+         thrown.
+       */
+      rc = xscreensaver_logind_watch (ctx, DBUS_SD_MATCH,
+                                      xscreensaver_systemd_handler);
+      if (rc < 0)
+        {
+          warnx ("dbus: add match failed: %s", strerror(-rc));
+          goto FAIL;
+        }
+
+      rc = xscreensaver_logind_watch (ctx, DBUS_SD_SHUTDOWN_MATCH,
+                                      xscreensaver_shutdown_handler);
+      if (rc >= 0)
+        rc = xscreensaver_logind_watch (ctx, DBUS_SD_LOCK_MATCH,
+                                        xscreensaver_session_lock_handler);
+      if (rc >= 0)
+        rc = xscreensaver_logind_watch (ctx, DBUS_SD_UNLOCK_MATCH,
+                                        xscreensaver_session_lock_handler);
+      if (rc < 0)
+        {
+          warnx ("dbus: add match failed: %s", strerror(-rc));
+          goto FAIL;
+        }
+    }
+
+  /* Lid changes are nice to have, so failing to hear about them is not
+     fatal: we will ask instead.  Only heartbeats care. */
+  if (!no_inhibit_p)
+    {
+      rc = xscreensaver_logind_watch (ctx, DBUS_SD_PROPERTIES_MATCH,
+                                      xscreensaver_properties_handler);
+      if (rc >= 0)
+        rc = sd_bus_add_match (system_bus, NULL,
+                               DBUS_UPOWER_PROPERTIES_MATCH,
+                               xscreensaver_properties_handler, &global_ctx);
+      if (rc < 0)
+        xlog (LOG_WARNING, "dbus: add match failed: %s", strerror(-rc));
+      xscreensaver_watch_lid (ctx);
+    }
+
+  xscreensaver_session_resolve_path (ctx, ctx->default_session);
+
+  if (ctx->all_sessions_p)
+    {
+      rc = xscreensaver_logind_watch (ctx, DBUS_SD_SESSION_NEW_MATCH,
+                                      xscreensaver_session_handler);
+      if (rc >= 0)
+        rc = xscreensaver_logind_watch (ctx, DBUS_SD_SESSION_REMOVED_MATCH,
+                                        xscreensaver_session_handler);
+      if (rc < 0)
+        {
+          warnx ("dbus: add match failed: %s", strerror(-rc));
+          goto FAIL;
+        }
+      xscreensaver_discover_sessions (ctx);
+    }
+
+  xscreensaver_calibrate (ctx);
+
+  if (spawn_helper_p)
+    xscreensaver_lock_memory ();
+
+  ctx->last_active = xscreensaver_secs();
+
+  /* Run an event loop forever, and wait for our callback to run.
+   */
+  t = xscreensaver_nsec();
+  while (1)
+    {
+      uint64_t poll_timeout, timeout, user_timeout;
+      struct inhibit_entry *entry, *next;
+      int nfds = 5;
+      int fd_base, i;
+
+      /*
+       * We MUST call sd_bus_process() on each bus at least once before calling
+       * sd_bus_get_events(), so just always start the event loop by processing
+       * all outstanding requests on both busses.
+       */
+      do
+        {
+          ctx->dispatch_name[0] = 0;
+          rc = sd_bus_process(system_bus, NULL);
+          if (rc < 0)
+            {
+               xlog(LOG_ERR, "Failed to process bus: %s", strerror(-rc));
+               goto FAIL;
+            }
+          t = xscreensaver_profile (ctx, SOURCE_SYSTEM_BUS, NULL, rc > 0, t);
+        }
+      while (rc > 0);
+
+      if (user_bus)
+        do
+          {
+            ctx->dispatch_name[0] = 0;
+            rc = sd_bus_process(user_bus, NULL);
+            if (rc < 0)
+              {
+                 xlog(LOG_ERR, "Failed to process bus: %s", strerror(-rc));
+                 goto FAIL;
+              }
+            t = xscreensaver_profile (ctx, SOURCE_USER_BUS, NULL, rc > 0, t);
+          }
+        while (rc > 0);
+
+      rc = xscreensaver_block_update (ctx);
+      t = xscreensaver_profile (ctx, SOURCE_SYSTEM_BUS, "block lock", rc, t);
+
+      /* Room for the buses, the log sink, the config watch, signals, an
+         X connection per session, and the InhibitFd pipes. */
+      if (ctx->nsessions + ctx->nfd_inhibitors + 5 > fds_size)
+        {
+          fds_size = ctx->nsessions + ctx->nfd_inhibitors + 5;
+          fds = realloc (fds, fds_size * sizeof (*fds));
+        }
+
+      fds[0].fd = sd_bus_get_fd(system_bus);
+      fds[0].events = sd_bus_get_events(system_bus);
+      fds[0].revents = 0;
+      fds[1].fd = user_bus ? sd_bus_get_fd(user_bus) : -1;
+      fds[1].events = user_bus ? sd_bus_get_events(user_bus) : 0;
+      fds[1].revents = 0;
+
+      /* Everything has been dispatched: now is when we can afford to
+         write log messages.  If the sink is full, wait for it too. */
+      if (record_file)
+        fflush (record_file);
+      fds[2].fd = xlog_flush() ? xlog_state.fd : -1;
+      t = xscreensaver_profile (ctx, SOURCE_LOG, "", 0, t);
+      fds[2].events = POLLOUT;
+      fds[2].revents = 0;
+      fds[3].fd = config_fd;
+      fds[3].events = POLLIN;
+      fds[3].revents = 0;
+      fds[4].fd = signal_fd;
+      fds[4].events = POLLIN;
+      fds[4].revents = 0;
+
+#ifdef HAVE_X11
+      LIST_FOREACH (s, &ctx->sessions, entries)
+        {
+          int events = xscreensaver_x_process (s);
+          if (!inhibit_only_p)
+            xscreensaver_idle_hint (ctx, s);
+          t = xscreensaver_profile (ctx, SOURCE_X11, s->id, events > 0, t);
+          if (!s->dpy)
+            continue;
+          fds[nfds].fd = ConnectionNumber (s->dpy);
+          fds[nfds].events = POLLIN;
+          fds[nfds].revents = 0;
+          nfds++;
+        }
+#endif
+
+      /* Nothing is ever read from these: POLLHUP is always reported. */
+      fd_base = nfds;
+      LIST_FOREACH (entry, &ctx->fd_inhibitors, by_fd)
+        {
+          fds[nfds].fd = entry->fd;
+          fds[nfds].events = 0;
+          fds[nfds].revents = 0;
+          nfds++;
+        }
+
+      /* These are CLOCK_MONOTONIC deadlines, not intervals. */
+      sd_bus_get_timeout(system_bus, &timeout);
+      user_timeout = UINT64_MAX;
+      if (user_bus)
+        sd_bus_get_timeout(user_bus, &user_timeout);
+      if (user_timeout < timeout)
+        timeout = user_timeout;
+      if (timeout == UINT64_MAX)
+        poll_timeout = -1;
+      else
+        {
+          uint64_t now = xscreensaver_usec();
+          poll_timeout = timeout > now ? (timeout - now + 999) / 1000 : 0;
+        }
+
+      /* And when our own timers are due. */
+      if (ctx->ninhibitors)
+        ctx->last_active = xscreensaver_secs();
+      poll_timeout = xscreensaver_timers_next (ctx, poll_timeout);
+
+      /* That is the end of one wakeup's work. */
+      if (ctx->wakeup_callbacks > ctx->stats.loop_callbacks_max)
+        ctx->stats.loop_callbacks_max = ctx->wakeup_callbacks;
+      ctx->wakeup_callbacks = 0;
+
+      t = xscreensaver_nsec();
+      rc = poll(fds, nfds, poll_timeout);
+      if (rc < 0)
+        err(EXIT_FAILURE, "poll()");
+      t0 = t;
+      t = xscreensaver_nsec();
+      ctx->stats.poll_nsec += t - t0;
+      ctx->stats.loop_wakeups++;
+
+      if (rc == 0)
+        ctx->stats.wakeups[WAKE_TIMEOUT]++;
+      if (fds[0].revents)
+        ctx->stats.wakeups[WAKE_SYSTEM_BUS]++;
+      if (fds[1].revents)
+        ctx->stats.wakeups[WAKE_USER_BUS]++;
+      xscreensaver_count_bytes (ctx, BUS_SYSTEM, &fds[0]);
+      xscreensaver_count_bytes (ctx, BUS_USER, &fds[1]);
+
+      if (fds[4].revents)
+        {
+          struct signalfd_siginfo si;
+          if (read (signal_fd, &si, sizeof(si)) == sizeof(si))
+            {
+              xlog (LOG_NOTICE, "caught %s, exiting",
+                    strsignal (si.ssi_signo));
+              break;
+            }
+        }
+
+      /* The list has not changed since we filled in fds[]. */
+      for (entry = LIST_FIRST (&ctx->fd_inhibitors), i = fd_base;
+           entry;
+           entry = next, i++)
+        {
+          next = LIST_NEXT (entry, by_fd);
+          if (fds[i].revents & (POLLHUP | POLLERR))
+            {
+              xscreensaver_inhibit_hangup (ctx, entry);
+              t = xscreensaver_profile (ctx, SOURCE_INHIBIT_FD, "", 1, t);
+            }
+        }
+
+      /* A new config takes effect from here: nothing is half way through
+         using the old one. */
+      if (fds[3].revents && config_changed_p (config_fd))
+        {
+          if (config_load () < 0)
+            ctx->stats.config_errors++;
+          else
+            ctx->stats.config_loads++;
+          t = xscreensaver_profile (ctx, SOURCE_CONFIG, "", 1, t);
+        }
+
+      /* Counted as a callback when it is what woke us. */
+      xscreensaver_timers_run (ctx);
+      t = xscreensaver_profile (ctx, SOURCE_TIMERS, "", rc == 0, t);
+
+      if (inhibit_only_p && ctx->ninhibitors == 0 &&
+          xscreensaver_secs() - ctx->last_active >= IDLE_EXIT_SECS &&
+          xscreensaver_user_bus_retire (ctx, user_bus))
+        break;
+    }
+
+  status = EXIT_SUCCESS;
+
+ FAIL:
+  xscreensaver_shutdown (ctx, user_bus);
+  xlog_drain ();
+  if (record_file)
+    fclose (record_file);
+  if (config_fd >= 0)
+    close (config_fd);
+  if (signal_fd >= 0)
+    close (signal_fd);
+  free (fds);
+
+  if (system_bus)
+    sd_bus_flush_close_unref (system_bus);
+
+  if (user_bus)
+    sd_bus_flush_close_unref (user_bus);
+
+  sd_bus_error_free (&error);
+
+  return status;
+}
+
+
+/* Replaying traces.
+
+   The replayer is a client of the daemon on the session bus, and also
+   stands in for logind there: it owns DBUS_SD_SERVICE_NAME, answers
+   "Inhibit" with the write end of a pipe, and watches the read end to see
+   when the daemon lets go.
+ */
+
+#define REPLAY_MAX_LOCKS    16
+#define REPLAY_LOCK_TIMEOUT 10000000    /* usec; logind's own is 5 s */
+
+struct replay_latency {
+  const char *name;
+  unsigned long n;
+  uint64_t total, max;
+};
+
+static struct {
+  sd_bus *bus;
+  int lock_fds[REPLAY_MAX_LOCKS];       /* Our ends of handed-out locks */
+  int nlocks;
+  unsigned long lock_calls;
+  uint32_t *cookie_from, *cookie_to;    /* Recorded cookie -> live one */
+  int ncookies, cookies_size;
+  struct replay_latency inhibit, uninhibit, renew, sleep, resume;
+  unsigned long failed;
+} replay;
+
+static void
+replay_account (struct replay_latency *l, uint64_t usec)
+{
+  l->n++;
+  l->total += usec;
+  if (usec > l->max)
+    l->max = usec;
+}
+
+static int
+replay_logind_inhibit (sd_bus_message *m, void *arg, sd_bus_error *ret_error)
+{
+  int fds[2];
+  int rc;
+
+  if (replay.nlocks >= REPLAY_MAX_LOCKS || pipe (fds) < 0)
+    return -EBUSY;
+  replay.lock_calls++;
+  rc = sd_bus_reply_method_return (m, "h", fds[1]);
+  close (fds[1]);       /* The bus has its own copy now */
+  replay.lock_fds[replay.nlocks++] = fds[0];
+  return rc;
+}
+
+static const sd_bus_vtable
+replay_logind_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("Inhibit", "ssss", "h", replay_logind_inhibit,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_VTABLE_END
+};
+
+/* Run the bus and watch our lock fds until 'deadline', or until 'done'
+   says we have seen what we are waiting for.
+ */
+static void
+replay_run_until (uint64_t deadline, int (*done) (void))
+{
+  while (1)
+    {
+      struct pollfd fds[REPLAY_MAX_LOCKS + 1];
+      uint64_t now;
+      int i, n, timeout;
+
+      while (sd_bus_process (replay.bus, NULL) > 0)
+        ;
+      if (done && done())
+        return;
+      now = xscreensaver_usec();
+      if (now >= deadline)
+        return;
+
+      fds[0].fd = sd_bus_get_fd (replay.bus);
+      fds[0].events = sd_bus_get_events (replay.bus);
+      for (i = 0; i < replay.nlocks; i++)
+        {
+          fds[i+1].fd = replay.lock_fds[i];
+          fds[i+1].events = POLLIN;
+        }
+      for (i = 0; i <= replay.nlocks; i++)
+        fds[i].revents = 0;
+      timeout = (deadline - now + 999) / 1000;
+      n = poll (fds, replay.nlocks + 1, timeout);
+      if (n < 0 && errno != EINTR)
+        err (EXIT_FAILURE, "poll()");
+
+      /* A lock whose other end has been closed has been released. */
+      for (i = replay.nlocks; i > 0; i--)
+        if (fds[i].revents & (POLLHUP | POLLERR))
+          {
+            close (replay.lock_fds[i-1]);
+            replay.lock_fds[i-1] = replay.lock_fds[--replay.nlocks];
+          }
+    }
+}
+
+static unsigned long replay_want_lock_calls;
+
+static int replay_locks_released (void) { return replay.nlocks == 0; }
+static int replay_lock_taken (void)
+{
+  return replay.lock_calls >= replay_want_lock_calls;
+}
+
+static uint32_t
+replay_map_cookie (uint32_t recorded)
+{
+  int i;
+  for (i = 0; i < replay.ncookies; i++)
+    if (replay.cookie_from[i] == recorded)
+      return replay.cookie_to[i];
+  return recorded;      /* Unknown then, unknown now */
+}
+
+static void
+replay_add_cookie (uint32_t recorded, uint32_t live)
+{
+  if (replay.ncookies >= replay.cookies_size)
+    {
+      replay.cookies_size = replay.cookies_size ? replay.cookies_size * 2 : 64;
+      replay.cookie_from = realloc (replay.cookie_from,
+                                    replay.cookies_size * sizeof(uint32_t));
+      replay.cookie_to = realloc (replay.cookie_to,
+                                  replay.cookies_size * sizeof(uint32_t));
+    }
+  replay.cookie_from[replay.ncookies] = recorded;
+  replay.cookie_to[replay.ncookies] = live;
+  replay.ncookies++;
+}
+
+static void
+replay_step (const struct record_entry *e, const char *strings)
+{
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *reply = NULL;
+  uint64_t start = xscreensaver_usec();
+  uint32_t cookie;
+  int rc;
+
+  switch (e->type)
+    {
+    case RECORD_INHIBIT:
+      /* Two strings, each ending within the record. */
+      if (e->len < 2 || strings[e->len - 1] ||
+          strlen (strings) + 1 >= e->len)
+        {
+          rc = -EBADMSG;
+          break;
+        }
+      if (e->arg == 0 || e->arg == INHIBIT_IDLE)
+        rc = sd_bus_call_method (replay.bus, DBUS_FDO_NAME,
+                                 DBUS_FDO_OBJECT_PATH, DBUS_FDO_INTERFACE,
+                                 "Inhibit", &error, &reply, "ss",
+                                 strings, strings + strlen (strings) + 1);
+      else
+        rc = sd_bus_call_method (replay.bus, DBUS_GSM_NAME,
+                                 DBUS_GSM_OBJECT_PATH, DBUS_GSM_INTERFACE,
+                                 "Inhibit", &error, &reply, "susu",
+                                 strings, 0, strings + strlen (strings) + 1,
+                                 (uint32_t) e->arg);
+      if (rc >= 0)
+        rc = sd_bus_message_read (reply, "u", &cookie);
+      if (rc < 0)
+        break;
+      replay_account (&replay.inhibit, xscreensaver_usec() - start);
+      replay_add_cookie (e->cookie, cookie);
+      break;
+
+    case RECORD_UNINHIBIT:
+    case RECORD_HANGUP:
+      /* Recorded inhibitors come back without a pipe, so one that was
+         dropped on hangup is given back by cookie instead. */
+      rc = sd_bus_call_method (replay.bus, DBUS_FDO_NAME,
+                               DBUS_FDO_OBJECT_PATH, DBUS_FDO_INTERFACE,
+                               "UnInhibit", &error, &reply, "u",
+                               replay_map_cookie (e->cookie));
+      if (rc >= 0)
+        replay_account (&replay.uninhibit, xscreensaver_usec() - start);
+      break;
+
+    case RECORD_RENEW:
+      rc = sd_bus_call_method (replay.bus, DBUS_CLIENT_NAME,
+                               DBUS_CLIENT_OBJECT_PATH,
+                               DBUS_CLIENT_INHIBIT_INTERFACE,
+                               "Renew", &error, &reply, "u",
+                               replay_map_cookie (e->cookie));
+      if (rc >= 0)
+        replay_account (&replay.renew, xscreensaver_usec() - start);
+      break;
+
+    case RECORD_SLEEP:
+      rc = sd_bus_emit_signal (replay.bus, DBUS_SD_OBJECT_PATH,
+                               DBUS_SD_INTERFACE, "PrepareForSleep",
+                               "b", (int) e->arg);
+      if (rc < 0)
+        break;
+      if (e->arg)
+        {
+          /* Sleep may go ahead once the daemon has closed its lock. */
+          replay_run_until (start + REPLAY_LOCK_TIMEOUT,
+                            replay_locks_released);
+          if (replay.nlocks)
+            rc = -ETIMEDOUT;
+          else
+            replay_account (&replay.sleep, xscreensaver_usec() - start);
+        }
+      else
+        {
+          /* Resumed once it has come back for a new lock. */
+          replay_want_lock_calls = replay.lock_calls + 1;
+          replay_run_until (start + REPLAY_LOCK_TIMEOUT, replay_lock_taken);
+          if (!replay_lock_taken())
+            rc = -ETIMEDOUT;
+          else
+            replay_account (&replay.resume, xscreensaver_usec() - start);
+        }
+      break;
+
+    case RECORD_START:
+      /* Cookies from the last run mean nothing in this one. */
+      replay.ncookies = 0;
+      rc = 0;
+      break;
+
+    default:
+      rc = -EINVAL;
+      break;
+    }
+
   if (rc < 0)
     {
-      warnx ("dbus: failed to connect as %s: %s",
-             DBUS_FDO_NAME, strerror(-rc));
-      goto FAIL;
+      replay.failed++;
+      warnx ("replay: '%c' at %lu usec failed: %s", e->type,
+             (unsigned long) e->usec,
+             error.message ? error.message : strerror(-rc));
     }
+  if (reply)
+    sd_bus_message_unref (reply);
+  sd_bus_error_free (&error);
+}
+
+/* Read the daemon's counters into 'out', indexed like 'names'. */
+static void
+replay_get_stats (const char * const *names, uint64_t *out)
+{
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *reply = NULL;
+  const char *name;
+  uint64_t value;
+  int i;
+
+  if (sd_bus_call_method (replay.bus, DBUS_CLIENT_NAME,
+                          DBUS_CLIENT_OBJECT_PATH,
+                          DBUS_CLIENT_STATS_INTERFACE, "GetStats",
+                          &error, &reply, "") < 0 ||
+      sd_bus_message_enter_container (reply, 'a', "{st}") <= 0)
+    goto DONE;
+  while (sd_bus_message_read (reply, "{st}", &name, &value) > 0)
+    for (i = 0; names[i]; i++)
+      if (!strcmp (name, names[i]))
+        out[i] = value;
+ DONE:
+  if (reply)
+    sd_bus_message_unref (reply);
+  sd_bus_error_free (&error);
+}
+
+static void
+replay_report (const struct replay_latency *l)
+{
+  if (!l->n)
+    return;
+  printf ("%-10s %8lu calls  avg %8lu usec  max %8lu usec\n",
+          l->name, l->n, (unsigned long) (l->total / l->n),
+          (unsigned long) l->max);
+}
 
-  rc = sd_bus_request_name (user_bus, DBUS_CLIENT_NAME, 0);
+static int
+xscreensaver_replay (const char *file, double speed)
+{
+  static const char * const counters[] = {
+    "commands_suspend", "commands_deactivate", "commands_lock",
+    "commands_failed", "heartbeats", NULL
+  };
+  uint64_t before[5], after[5];
+  struct record_header h;
+  struct record_entry e;
+  char strings[0x10000];
+  unsigned long nrecords = 0;
+  uint64_t start;
+  FILE *in;
+  int rc, i;
+
+  in = fopen (file, "rb");
+  if (!in)
+    err (EXIT_FAILURE, "%s", file);
+  if (fread (&h, sizeof(h), 1, in) != 1 ||
+      memcmp (h.magic, RECORD_MAGIC, sizeof(h.magic)) ||
+      h.version != RECORD_VERSION ||
+      h.byte_order != 0x01020304)
+    errx (EXIT_FAILURE, "%s: not a trace from this machine and version",
+          file);
+
+  replay.inhibit.name = "Inhibit";
+  replay.uninhibit.name = "UnInhibit";
+  replay.renew.name = "Renew";
+  replay.sleep.name = "sleep";
+  replay.resume.name = "resume";
+
+  rc = sd_bus_open_user (&replay.bus);
+  if (rc >= 0)
+    rc = sd_bus_add_object_vtable (replay.bus, NULL, DBUS_SD_OBJECT_PATH,
+                                   DBUS_SD_INTERFACE, replay_logind_vtable,
+                                   NULL);
+  if (rc >= 0)
+    rc = sd_bus_request_name (replay.bus, DBUS_SD_SERVICE_NAME, 0);
   if (rc < 0)
+    errx (EXIT_FAILURE, "replay: cannot set up the private bus: %s",
+          strerror(-rc));
+
+  /* Give a daemon that is already waiting for logind a moment to find
+     us, then start from a clean count. */
+  replay_run_until (xscreensaver_usec() + 200000, NULL);
+  memset (before, 0, sizeof(before));
+  memset (after, 0, sizeof(after));
+  replay_get_stats (counters, before);
+
+  start = xscreensaver_usec();
+  while (fread (&e, sizeof(e), 1, in) == 1)
     {
-      warnx ("dbus: failed to connect as %s: %s",
-             DBUS_CLIENT_NAME, strerror(-rc));
-      goto FAIL;
+      if (e.len && fread (strings, e.len, 1, in) != 1)
+        break;
+      strings[e.len] = 0;
+      if (e.type == RECORD_START)
+        start = xscreensaver_usec();
+      if (speed > 0)
+        {
+          uint64_t due = start + (uint64_t) (e.usec / speed);
+          replay_run_until (due, NULL);
+        }
+      replay_step (&e, strings);
+      nrecords++;
     }
+  fclose (in);
 
+  replay_run_until (xscreensaver_usec() + 200000, NULL);
+  replay_get_stats (counters, after);
 
-  /* 'system_bus' is where we hold a lock on org.freedesktop.login1, meaning
-     that the system will send us a PrepareForSleep message when the system is
-     about to suspend.
-   */
+  printf ("replayed %lu records in %lu ms, %lu failed\n", nrecords,
+          (unsigned long) ((xscreensaver_usec() - start) / 1000),
+          replay.failed);
+  replay_report (&replay.inhibit);
+  replay_report (&replay.uninhibit);
+  replay_report (&replay.renew);
+  replay_report (&replay.sleep);
+  replay_report (&replay.resume);
+  for (i = 0; counters[i]; i++)
+    printf ("%-20s %lu\n", counters[i],
+            (unsigned long) (after[i] - before[i]));
 
-  rc = sd_bus_open_system (&system_bus);
-  if (rc < 0)
+  for (i = 0; i < replay.nlocks; i++)
+    close (replay.lock_fds[i]);
+  free (replay.cookie_from);
+  free (replay.cookie_to);
+  sd_bus_flush_close_unref (replay.bus);
+  return replay.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+#ifndef HAVE_LIBSYSTEMD
+
+/* Microbenchmarks, run in-process against the fake bus: "make bench".
+
+   The registry benchmark keeps a fixed number of live cookies and
+   repeatedly UnInhibits a random one and Inhibits a replacement, so that
+   lookups land all over the registry rather than at its head.
+ */
+
+static uint64_t
+bench_nsec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t
+bench_inhibit (sd_bus *bus)
+{
+  sd_bus_message *reply = NULL;
+  uint32_t cookie = 0;
+  if (sd_bus_call_method (bus, DBUS_FDO_NAME, DBUS_FDO_OBJECT_PATH,
+                          DBUS_FDO_INTERFACE, "Inhibit", NULL, &reply,
+                          "ss", "bench", "benchmarking") < 0 ||
+      sd_bus_message_read (reply, "u", &cookie) <= 0)
+    errx (1, "bench: Inhibit failed");
+  sd_bus_message_unref (reply);
+  return cookie;
+}
+
+static void
+bench_uninhibit (sd_bus *bus, uint32_t cookie)
+{
+  sd_bus_message *reply = NULL;
+  if (sd_bus_call_method (bus, DBUS_FDO_NAME, DBUS_FDO_OBJECT_PATH,
+                          DBUS_FDO_INTERFACE, "UnInhibit", NULL, &reply,
+                          "u", cookie) < 0)
+    errx (1, "bench: UnInhibit failed");
+  sd_bus_message_unref (reply);
+}
+
+static void
+bench_report (const char *what, int live, long n, uint64_t nsec)
+{
+  printf ("%-12s live=%-6d %9ld ops %8lu.%lu ns/op\n", what, live, n,
+          (unsigned long) (nsec / n),
+          (unsigned long) (nsec * 10 / n % 10));
+}
+
+static void
+bench_registry (sd_bus *bus, int live, long iterations)
+{
+  uint32_t *cookies = calloc (live, sizeof(*cookies));
+  uint64_t t0, t1, t2, inhibit_ns = 0, uninhibit_ns = 0;
+  long n;
+  int i;
+
+  for (i = 0; i < live; i++)
+    cookies[i] = bench_inhibit (bus);
+
+  for (n = 0; n < iterations; n++)
     {
-      warnx ("dbus: open failed: %s", strerror(-rc));
-      goto FAIL;
+      int k = lrand48() % live;
+      t0 = bench_nsec();
+      bench_uninhibit (bus, cookies[k]);
+      t1 = bench_nsec();
+      cookies[k] = bench_inhibit (bus);
+      t2 = bench_nsec();
+      uninhibit_ns += t1 - t0;
+      inhibit_ns += t2 - t1;
     }
 
-  /* Obtain a lock fd from the "Inhibit" method, so that we can delay
-     sleep when a "PrepareForSleep" signal is posted. */
+  bench_report ("Inhibit", live, iterations, inhibit_ns);
+  bench_report ("UnInhibit", live, iterations, uninhibit_ns);
+
+  for (i = 0; i < live; i++)
+    bench_uninhibit (bus, cookies[i]);
+  free (cookies);
+}
+
+/* One PrepareForSleep(true) + PrepareForSleep(false) round, including
+   the fake logind round trip to take the lock again.
+ */
+static void
+bench_sleep_once (sd_bus *bus)
+{
+  fake_logind_sleep (bus, 1);
+  fake_logind_sleep (bus, 0);
+  while (sd_bus_process (bus, NULL) > 0)
+    ;
+}
+
+static void
+bench_sleep (sd_bus *bus, long iterations)
+{
+  uint64_t t0 = bench_nsec();
+  long n;
+
+  for (n = 0; n < iterations; n++)
+    bench_sleep_once (bus);
+  bench_report ("sleep cycle", 0, iterations, bench_nsec() - t0);
+}
+
+/* What the event loop profiler adds to each callback. */
+static void
+bench_profile (long iterations)
+{
+  struct handler_ctx *ctx = &global_ctx;
+  uint64_t t0 = bench_nsec(), t = xscreensaver_nsec();
+  long i;
+
+  for (i = 0; i < iterations; i++)
+    t = xscreensaver_profile (ctx, SOURCE_SYSTEM_BUS, NULL, 1, t);
+  bench_report ("profile", 0, iterations, bench_nsec() - t0);
+}
+
+static int
+xscreensaver_bench (void)
+{
+  struct handler_ctx *ctx = &global_ctx;
+  sd_bus *user_bus = NULL, *system_bus = NULL;
+  static const int live[] = { 1, 100, 10000 };
+  static const long iterations[] = { 1000000, 1000000, 20000 };
+  int i;
+
+  dry_run_p = 1;
+  srand48 (1);
+  xscreensaver_session_add (ctx, "bench", ":0", NULL);
 
+  sd_bus_open_user (&user_bus);
+  sd_bus_add_object_vtable (user_bus, NULL, DBUS_FDO_OBJECT_PATH,
+                            DBUS_FDO_INTERFACE, xscreensaver_dbus_vtable,
+                            ctx);
+  sd_bus_open_system (&system_bus);
   ctx->system_bus = system_bus;
-  rc = xscreensaver_register_sleep_lock (ctx);
-  if (rc < 0)
-    goto FAIL;
+  xscreensaver_logind_start (ctx);
+  xscreensaver_sleep_acquire (ctx);
+  while (sd_bus_process (system_bus, NULL) > 0)
+    ;
+  if (ctx->sleep_state != SLEEP_HELD)
+    errx (1, "bench: could not take the sleep lock");
+  xscreensaver_logind_watch (ctx, DBUS_SD_MATCH,
+                             xscreensaver_systemd_handler);
 
+  for (i = 0; i < (int) (sizeof(live) / sizeof(*live)); i++)
+    bench_registry (user_bus, live[i], iterations[i]);
+  bench_sleep (system_bus, 100000);
+  bench_profile (1000000);
 
-  /* This is basically an event mask, saying that we are interested in
-     "PrepareForSleep", and to run our callback when that signal is thrown.
-   */
-  rc = sd_bus_add_match (system_bus, NULL, DBUS_SD_MATCH,
-                         xscreensaver_systemd_handler,
-                         &global_ctx);
-  if (rc < 0)
+  xscreensaver_release_lock (&ctx->sleep_lock);
+  sd_bus_flush_close_unref (system_bus);
+  sd_bus_flush_close_unref (user_bus);
+  xlog_drain ();
+  return 0;
+}
+
+/* Soak test, also against the fake bus: "make soak" or "-soak ROUNDS".
+
+   Each round is SOAK_PAIRS Inhibit/UnInhibit pairs, SOAK_FD_CALLS
+   InhibitFd calls whose pipes are then hung up, and SOAK_SLEEPS suspend
+   and resume cycles, after which we sample RSS, the heap in use, open
+   fds and live fake messages.  The first round is warm-up.  From then
+   on, none of them may grow past the first sample by more than the slack
+   below, and the sleep lock must be held by exactly one reference.
+ */
+
+#define SOAK_PAIRS       100000
+#define SOAK_FD_CALLS    1000
+#define SOAK_SLEEPS      500
+#define SOAK_RSS_SLACK   512            /* kB */
+#define SOAK_HEAP_SLACK  (64 * 1024)    /* bytes */
+
+struct soak_sample {
+  long rss_kb;
+  long fds;
+  long heap;
+  long messages;
+};
+
+static long
+soak_rss_kb (void)
+{
+  FILE *f = fopen ("/proc/self/status", "r");
+  char line[256];
+  long kb = -1;
+
+  if (!f)
+    return -1;
+  while (fgets (line, sizeof(line), f))
+    if (!strncmp (line, "VmRSS:", 6))
+      {
+        kb = atol (line + 6);
+        break;
+      }
+  fclose (f);
+  return kb;
+}
+
+static long
+soak_fds (void)
+{
+  DIR *dir = opendir ("/proc/self/fd");
+  struct dirent *e;
+  long n = 0;
+
+  if (!dir)
+    return -1;
+  while ((e = readdir (dir)))
+    if (e->d_name[0] != '.')
+      n++;
+  closedir (dir);
+  return n - 1;         /* Not counting opendir()'s own */
+}
+
+static long
+soak_heap (void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  return (long) mallinfo2().uordblks;
+#elif defined(__GLIBC__)
+  return mallinfo().uordblks;
+#else
+  return 0;
+#endif
+}
+
+static void
+soak_sample (struct soak_sample *s)
+{
+  s->rss_kb = soak_rss_kb();
+  s->fds = soak_fds();
+  s->heap = soak_heap();
+  s->messages = fake_messages;
+}
+
+static void
+soak_inhibit_fd (struct handler_ctx *ctx, sd_bus *bus)
+{
+  struct inhibit_entry *entry, *next;
+  sd_bus_message *reply = NULL;
+  struct pollfd pfd;
+
+  /* The fake does not pass fds across, so the client's end is already
+     closed by the time the reply gets here. */
+  if (sd_bus_call_method (bus, DBUS_CLIENT_NAME, DBUS_CLIENT_OBJECT_PATH,
+                          DBUS_CLIENT_INHIBIT_INTERFACE, "InhibitFd", NULL,
+                          &reply, "ss", "soak", "soaking") < 0)
+    errx (1, "soak: InhibitFd failed");
+  sd_bus_message_unref (reply);
+
+  for (entry = LIST_FIRST (&ctx->fd_inhibitors); entry; entry = next)
     {
-      warnx ("dbus: add match failed: %s", strerror(-rc));
-      goto FAIL;
+      next = LIST_NEXT (entry, by_fd);
+      pfd.fd = entry->fd;
+      pfd.events = 0;
+      if (poll (&pfd, 1, 0) > 0 && (pfd.revents & POLLHUP))
+        xscreensaver_inhibit_hangup (ctx, entry);
     }
+}
 
-  /* Run an event loop forever, and wait for our callback to run.
-   */
-  while (1)
+static int
+soak_check (const char *what, long base, long now, long slack)
+{
+  if (now - base <= slack)
+    return 0;
+  printf ("soak: %s grew from %ld to %ld\n", what, base, now);
+  return 1;
+}
+
+static int
+xscreensaver_soak (int rounds)
+{
+  struct handler_ctx *ctx = &global_ctx;
+  sd_bus *user_bus = NULL, *system_bus = NULL;
+  struct soak_sample start, base, now;
+  int failed = 0;
+  int round;
+  long n;
+
+  dry_run_p = 1;
+  soak_sample (&start);
+  base = start;         /* Until the warm-up round is over */
+  xscreensaver_session_add (ctx, "soak", ":0", NULL);
+  if (xscreensaver_user_bus_open (ctx, &user_bus) < 0)
+    errx (1, "soak: could not set up the user bus");
+  sd_bus_open_system (&system_bus);
+  ctx->system_bus = system_bus;
+  xscreensaver_logind_start (ctx);
+  xscreensaver_sleep_acquire (ctx);
+  while (sd_bus_process (system_bus, NULL) > 0)
+    ;
+  xscreensaver_logind_watch (ctx, DBUS_SD_MATCH,
+                             xscreensaver_systemd_handler);
+
+  printf ("%5s %9s %9s %6s %9s\n", "round", "rss kB", "heap", "fds",
+          "messages");
+  for (round = 0; round < rounds && !failed; round++)
     {
-      struct pollfd fds[2];
-      uint64_t poll_timeout, timeout, user_timeout;
+      for (n = 0; n < SOAK_PAIRS; n++)
+        bench_uninhibit (user_bus, bench_inhibit (user_bus));
+      for (n = 0; n < SOAK_FD_CALLS; n++)
+        soak_inhibit_fd (ctx, user_bus);
+      for (n = 0; n < SOAK_SLEEPS; n++)
+        bench_sleep_once (system_bus);
+      xlog_drain ();
 
-      /*
-       * We MUST call sd_bus_process() on each bus at least once before calling
-       * sd_bus_get_events(), so just always start the event loop by processing
-       * all outstanding requests on both busses.
-       */
-      do
+      soak_sample (&now);
+      printf ("%5d %9ld %9ld %6ld %9ld\n", round, now.rss_kb, now.heap,
+              now.fds, now.messages);
+      fflush (stdout);
+
+      if (ctx->ninhibitors)
         {
-          rc = sd_bus_process(system_bus, NULL);
-          if (rc < 0)
-            {
-               warnx("Failed to process bus: %s", strerror(-rc));
-               goto FAIL;
-            }
+          printf ("soak: %d inhibitors left over\n", ctx->ninhibitors);
+          failed = 1;
         }
-      while (rc > 0);
-
-      do
+      if (ctx->sleep_state != SLEEP_HELD || ctx->sleep_lock.fd < 0 ||
+          ctx->sleep_lock.message->ref != 1)
         {
-          rc = sd_bus_process(user_bus, NULL);
-          if (rc < 0)
-            {
-               warnx("Failed to process bus: %s", strerror(-rc));
-               goto FAIL;
-            }
+          printf ("soak: sleep lock is %s, fd %d, %d refs\n",
+                  sleep_state_names[ctx->sleep_state], ctx->sleep_lock.fd,
+                  ctx->sleep_lock.message ? ctx->sleep_lock.message->ref : 0);
+          failed = 1;
         }
-      while (rc > 0);
 
-      fds[0].fd = sd_bus_get_fd(system_bus);
-      fds[0].events = sd_bus_get_events(system_bus);
-      fds[0].revents = 0;
-      fds[1].fd = sd_bus_get_fd(user_bus);
-      fds[1].events = sd_bus_get_events(user_bus);
-      fds[1].revents = 0;
-
-      sd_bus_get_timeout(system_bus, &timeout);
-      sd_bus_get_timeout(user_bus, &user_timeout);
-      if (timeout == 0 && user_timeout == 0)
-        poll_timeout = 0;
-      else if (timeout == UINT64_MAX && user_timeout == UINT64_MAX)
-        poll_timeout = -1;
+      if (round == 0)
+        base = now;
       else
         {
-          poll_timeout = (timeout < user_timeout) ? timeout : user_timeout;
-          poll_timeout /= 1000000;
+          failed |= soak_check ("RSS", base.rss_kb, now.rss_kb,
+                                SOAK_RSS_SLACK);
+          failed |= soak_check ("heap", base.heap, now.heap,
+                                SOAK_HEAP_SLACK);
+          failed |= soak_check ("open fds", base.fds, now.fds, 0);
+          failed |= soak_check ("messages", base.messages, now.messages, 0);
         }
+    }
 
-      /*
-         We want to wake up at least once every 50 seconds, to de-activate
-         the screensaver if we have been inhibited.
-       */
-      if (poll_timeout > 50000)
-        poll_timeout = 50000;
+  /* What is still allocated after this was never given back. */
+  xscreensaver_shutdown (ctx, user_bus);
+  sd_bus_flush_close_unref (system_bus);
+  sd_bus_flush_close_unref (user_bus);
+  xlog_drain ();
+  soak_sample (&now);
+  printf ("%5s %9ld %9ld %6ld %9ld\n", "end", now.rss_kb, now.heap,
+          now.fds, now.messages);
+  failed |= soak_check ("open fds", start.fds, now.fds, 0);
+  failed |= soak_check ("messages", start.messages, now.messages, 0);
 
-      rc = poll(fds, 2, poll_timeout);
-      if (rc < 0)
-        err(EXIT_FAILURE, "poll()");
+  printf ("soak: %s\n", failed ? "FAILED" : "ok");
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Simulation.
+
+   "-simulate SCRIPT" runs the handlers and timers against the fake bus
+   and a virtual clock, so that a day of inhibitors, heartbeats and
+   suspends takes milliseconds.  Commands are not run: each one that
+   would have been is printed with its virtual time, and the counters
+   from GetStats follow at the end.  Each line of the script is
+
+     SECONDS EVENT [ARGS]
 
-      if (ctx->is_inhibited)
+   with SECONDS counted from the start, in order.  Blank lines and lines
+   starting with '#' are skipped.  The events are:
+
+     inhibit APP REASON   Inhibit on org.freedesktop.ScreenSaver
+     uninhibit N          UnInhibit the cookie from the Nth inhibit
+     sleep                PrepareForSleep(true)
+     resume               PrepareForSleep(false)
+     spoof                PrepareForSleep(true), but not from logind
+     restart              logind restarts, and comes back with a new name
+     takeover             With -standby: the active copy exits
+     jump SECONDS         Step the wall clock, e.g. by NTP or "date -s"
+     end                  Stop; the timers run up to here first
+
+   Between events, time jumps straight to whichever timer is due next.
+ */
+
+/* Where the virtual clock starts: as if the machine had been up a day. */
+#define SIMULATE_EPOCH_USEC ((uint64_t) 86400 * 1000000)
+
+static void
+simulate_settle (sd_bus *system_bus, sd_bus *user_bus)
+{
+  int busy;
+  do
+    {
+      busy = 0;
+      while (sd_bus_process (system_bus, NULL) > 0)
+        busy = 1;
+      while (sd_bus_process (user_bus, NULL) > 0)
+        busy = 1;
+    }
+  while (busy);
+}
+
+/* Moves the clock to 'until', stopping at every timer on the way. */
+static void
+simulate_advance (struct handler_ctx *ctx, sd_bus *system_bus,
+                  sd_bus *user_bus, uint64_t until)
+{
+  while (1)
+    {
+      uint64_t wait = xscreensaver_timers_next (ctx, UINT64_MAX);
+      if (wait == UINT64_MAX || virtual_usec + wait * 1000 > until)
+        break;
+      virtual_usec += wait * 1000;
+      xscreensaver_timers_run (ctx);
+      simulate_settle (system_bus, user_bus);
+    }
+  virtual_usec = until;
+}
+
+static int
+xscreensaver_simulate (const char *file)
+{
+  struct handler_ctx *ctx = &global_ctx;
+  sd_bus *user_bus = NULL, *system_bus = NULL;
+  uint32_t *cookies = NULL;
+  int ncookies = 0, cookies_size = 0;
+  char line[1024];
+  int lineno = 0;
+  int i;
+  FILE *in = fopen (file, "r");
+
+  if (!in)
+    err (1, "%s", file);
+
+  dry_run_p = 1;
+  config_load ();
+  virtual_clock_p = 1;
+  virtual_usec = virtual_epoch = SIMULATE_EPOCH_USEC;
+  virtual_wall_offset = time (NULL) - virtual_usec / 1000000;
+
+  xscreensaver_session_add (ctx, "sim", ":0", NULL);
+  fake_names_taken = standby_p;
+  if (xscreensaver_user_bus_open (ctx, &user_bus) < 0)
+    return 1;
+  sd_bus_open_system (&system_bus);
+  ctx->system_bus = system_bus;
+  ctx->sleep_state_since = xscreensaver_usec();
+  xscreensaver_logind_start (ctx);
+  xscreensaver_sleep_acquire (ctx);
+  xscreensaver_logind_watch (ctx, DBUS_SD_MATCH,
+                             xscreensaver_systemd_handler);
+  simulate_settle (system_bus, user_bus);
+
+  while (fgets (line, sizeof(line), in))
+    {
+      char event[32], a[256], b[256];
+      double secs;
+      uint64_t at;
+      int n;
+
+      lineno++;
+      n = sscanf (line, "%lf %31s %255s %255s", &secs, event, a, b);
+      if (n <= 0 || line[strspn (line, " \t")] == '#')
+        continue;
+      if (n < 2 || secs < 0)
+        errx (1, "%s:%d: expected SECONDS EVENT", file, lineno);
+
+      at = virtual_epoch + (uint64_t) (secs * 1000000);
+      if (at < virtual_usec)
+        errx (1, "%s:%d: time goes backwards", file, lineno);
+      simulate_advance (ctx, system_bus, user_bus, at);
+      printf ("%7lu.%03lu %s%s%s%s%s\n",
+              (unsigned long) ((at - virtual_epoch) / 1000000),
+              (unsigned long) ((at - virtual_epoch) / 1000 % 1000), event,
+              n > 2 ? " " : "", n > 2 ? a : "",
+              n > 3 ? " " : "", n > 3 ? b : "");
+
+      if (!strcmp (event, "inhibit") && n == 4)
         {
-          now = time(NULL);
-          if (now - last_deactivate_time >= 50)
+          sd_bus_message *reply = NULL;
+          if (ncookies >= cookies_size)
             {
-              if (verbose_p)
-                warnx("%d active inhibitors, deactivating screensaver",
-                    ctx->is_inhibited);
-              xscreensaver_command("deactivate");
-              last_deactivate_time = now;
+              cookies_size = cookies_size ? cookies_size * 2 : 64;
+              cookies = realloc (cookies, cookies_size * sizeof(*cookies));
+              if (!cookies)
+                errx (1, "out of memory");
             }
+          if (sd_bus_call_method (user_bus, DBUS_FDO_NAME,
+                                  DBUS_FDO_OBJECT_PATH, DBUS_FDO_INTERFACE,
+                                  "Inhibit", NULL, &reply, "ss", a, b) < 0 ||
+              sd_bus_message_read (reply, "u", &cookies[ncookies]) <= 0)
+            errx (1, "%s:%d: Inhibit failed", file, lineno);
+          ncookies++;
+          sd_bus_message_unref (reply);
         }
-    }
-
- FAIL:
-  if (system_bus)
-    sd_bus_flush_close_unref (system_bus);
+      else if (!strcmp (event, "uninhibit") && n == 3)
+        {
+          sd_bus_message *reply = NULL;
+          int k = atoi (a);
+          if (k < 1 || k > ncookies)
+            errx (1, "%s:%d: no inhibit number %s", file, lineno, a);
+          sd_bus_call_method (user_bus, DBUS_FDO_NAME,
+                              DBUS_FDO_OBJECT_PATH, DBUS_FDO_INTERFACE,
+                              "UnInhibit", NULL, &reply, "u", cookies[k-1]);
+          sd_bus_message_unref (reply);
+        }
+      else if (!strcmp (event, "sleep") || !strcmp (event, "resume"))
+        fake_logind_sleep (system_bus, !strcmp (event, "sleep"));
+      else if (!strcmp (event, "spoof"))
+        fake_bus_signal_from (system_bus, ":1.666", DBUS_SD_OBJECT_PATH,
+                              DBUS_SD_INTERFACE, "PrepareForSleep", "b", 1);
+      else if (!strcmp (event, "restart"))
+        fake_logind_restart (system_bus);
+      else if (!strcmp (event, "takeover"))
+        {
+          fake_names_taken = 0;
+          fake_bus_signal_from (user_bus, FAKE_DAEMON_NAME,
+                                DBUS_DAEMON_OBJECT_PATH, DBUS_DAEMON_INTERFACE,
+                                "NameAcquired", "s", DBUS_FDO_NAME);
+        }
+      else if (!strcmp (event, "jump") && n == 3)
+        virtual_wall_offset += atol (a);
+      else if (!strcmp (event, "end"))
+        break;
+      else
+        errx (1, "%s:%d: bad event \"%s\"", file, lineno, event);
 
-  if (user_bus)
-    sd_bus_flush_close_unref (user_bus);
+      simulate_settle (system_bus, user_bus);
+    }
+  fclose (in);
 
-  sd_bus_error_free (&error);
+  printf ("heartbeats %lu hidden %lu skipped %lu leases_expired %lu\n",
+          (unsigned long) ctx->stats.heartbeats,
+          (unsigned long) ctx->stats.heartbeats_hidden,
+          (unsigned long) ctx->stats.heartbeats_skipped,
+          (unsigned long) ctx->stats.leases_expired);
+  for (i = 0; i < XSS_NVERBS; i++)
+    printf ("commands_%s %lu\n", xscreensaver_verbs[i],
+            (unsigned long) ctx->stats.commands[i]);
+  printf ("sleep_out_of_order %lu sleep_acquire_failed %lu "
+          "logind_restarts %lu\n",
+          (unsigned long) ctx->stats.sleep_out_of_order,
+          (unsigned long) ctx->stats.sleep_acquire_failed,
+          (unsigned long) ctx->stats.logind_restarts);
+  printf ("resume_ready %lu retries %lu gave_up %lu\n",
+          (unsigned long) ctx->stats.resume_ready,
+          (unsigned long) ctx->stats.resume_retries,
+          (unsigned long) ctx->stats.resume_gave_up);
 
-  return EXIT_FAILURE;
+  free (cookies);
+  xscreensaver_release_lock (&ctx->sleep_lock);
+  sd_bus_flush_close_unref (system_bus);
+  sd_bus_flush_close_unref (user_bus);
+  xlog_drain ();
+  return 0;
 }
 
+#endif /* !HAVE_LIBSYSTEMD */
+
 
 static char *usage = "\n\
-usage: %s [-verbose]\n\
-\n\
+usage: %s [-verbose] [-all-sessions] [-spawn-helper] [-record|-replay file]\n\
+          [-lease pattern=seconds] [-private-bus] [-speed n]\n\
+          [-session-manager] [-inhibit-only|-no-inhibit|-standby]\n"
+#ifndef HAVE_LIBSYSTEMD
+"          [-simulate script|-bench|-soak rounds]\n"
+#endif
+;
+
+/* The rest is kept apart, as no one string literal in C89 is promised
+   more than 509 characters. */
+static char *usage_options = "\n\
+  -lease pattern=seconds  expire matching apps' inhibitors unless renewed\n\
+  -private-bus            use the session bus in place of the system bus\n\
+  -speed n                play a -replay trace n times faster\n\
+  -session-manager        also take Inhibit calls for GNOME and MATE\n\
+  -inhibit-only           only serve inhibitors, as started by the bus\n\
+  -no-inhibit             only hold the sleep locks, with no session bus\n\
+  -standby                if our names are taken, wait in line for them\n";
+
+#ifndef HAVE_LIBSYSTEMD
+/* Only the build against the fake bus has these. */
+static char *usage_fake = "\
+  -simulate script        play a script at virtual times, print commands\n\
+  -bench                  time the hot paths against the fake bus\n\
+  -soak rounds            check that nothing grows over many rounds\n";
+# define USAGE_FAKE() fputs (usage_fake, stderr)
+#else
+# define USAGE_FAKE() do { } while (0)
+#endif
+
+static char *usage_about = "\n\
 This program is launched by the xscreensaver daemon to monitor DBus.\n\
 It invokes 'xscreensaver-command' to tell the xscreensaver daemon to lock\n\
 the screen before the system suspends, e.g., when a laptop's lid is closed.\n\
@@ -670,7 +7619,10 @@ From XScreenSaver %s, (c) 1991-%s Jamie Zawinski <jwz@jwz.org>.\n";
 
 
 #define USAGE() do { \
- fprintf (stderr, usage, progname, screensaver_version, year); exit (1); \
+ fprintf (stderr, usage, progname); \
+ fputs (usage_options, stderr); \
+ USAGE_FAKE(); \
+ fprintf (stderr, usage_about, screensaver_version, year); exit (1); \
  } while(0)
 
 
@@ -680,6 +7632,13 @@ main (int argc, char **argv)
   int i;
   char *s;
   char year[5];
+  const char *replay_file = NULL;
+  double speed = 1;
+#ifndef HAVE_LIBSYSTEMD
+  int bench_p = 0;
+  int soak_rounds = 0;
+  const char *simulate_file = NULL;
+#endif
 
   progname = argv[0];
   s = strrchr (progname, '/');
@@ -704,8 +7663,57 @@ main (int argc, char **argv)
       if (L < 2) USAGE ();
       else if (!strncmp (s, "-verbose", L)) verbose_p = 1;
       else if (!strncmp (s, "-quiet",   L)) verbose_p = 0;
+      else if (!strcmp (s, "-all-sessions")) global_ctx.all_sessions_p = 1;
+      else if (!strcmp (s, "-spawn-helper")) spawn_helper_p = 1;
+      else if (!strcmp (s, "-private-bus")) private_bus_p = 1;
+      else if (!strcmp (s, "-inhibit-only")) inhibit_only_p = 1;
+      else if (!strcmp (s, "-no-inhibit")) no_inhibit_p = 1;
+      else if (!strcmp (s, "-standby")) standby_p = 1;
+      else if (!strcmp (s, "-session-manager")) session_manager_p = 1;
+      else if (!strcmp (s, "-lease") && i+1 < argc)
+        {
+          if (lease_rule_add (argv[++i]) < 0)
+            USAGE();
+        }
+      else if (!strcmp (s, "-record") && i+1 < argc)
+        {
+          if (xscreensaver_record_open (argv[++i]) < 0)
+            exit (1);
+        }
+      else if (!strcmp (s, "-replay") && i+1 < argc)
+        replay_file = argv[++i];
+      else if (!strcmp (s, "-speed") && i+1 < argc)
+        speed = atof (argv[++i]);
+#ifndef HAVE_LIBSYSTEMD
+      else if (!strcmp (s, "-bench")) bench_p = 1;
+      else if (!strcmp (s, "-soak") && i+1 < argc)
+        soak_rounds = atoi (argv[++i]);
+      else if (!strcmp (s, "-simulate") && i+1 < argc)
+        simulate_file = argv[++i];
+#endif
       else USAGE ();
     }
 
+  if (inhibit_only_p && no_inhibit_p)
+    USAGE ();
+  /* Either there is no name to queue for, or we give it up when idle. */
+  if (standby_p && (inhibit_only_p || no_inhibit_p))
+    USAGE ();
+
+  if (verbose_p)
+    log_level = LOG_DEBUG;
+  xlog_init ();
+
+#ifndef HAVE_LIBSYSTEMD
+  if (bench_p)
+    exit (xscreensaver_bench());
+  if (soak_rounds > 0)
+    exit (xscreensaver_soak (soak_rounds));
+  if (simulate_file)
+    exit (xscreensaver_simulate (simulate_file));
+#endif
+  if (replay_file)
+    exit (xscreensaver_replay (replay_file, speed));
+
   exit (xscreensaver_systemd_loop());
 }